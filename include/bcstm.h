@@ -0,0 +1,84 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#ifndef BCSTM_H
+#define BCSTM_H
+
+#include "common.h"
+#include "fs.h"
+
+typedef enum {
+    BCSTM_PCM8 = 0,
+    BCSTM_PCM16,
+    BCSTM_DSP_ADPCM,
+} BcstmEncoding;
+
+typedef struct {
+    s16 coefs[16];
+    s16 start_yn1, start_yn2; // history at the start of the file
+    s16 yn1, yn2; // history while decoding
+    s16 *pcm; // the current block, decoded
+} Bcstm_Channel_s;
+
+// Streams a BCSTM (the format of the installed bgm) as 16-bit stereo.
+// Only the first two channels are played, mono is played on both sides.
+typedef struct {
+    Stream_s *stream;
+
+    BcstmEncoding encoding;
+    bool looping;
+    u8 file_channels;
+    u8 channels;
+    u32 sample_rate;
+    u32 loop_start;
+    u32 sample_count;
+
+    u32 block_count;
+    u32 block_size;
+    u32 block_samples;
+    u32 last_block_size;
+    u32 last_block_samples;
+    u32 last_block_padded_size;
+    u32 data_offset;
+
+    s16 *seek_table; // history at the start of every block, for every channel
+    Bcstm_Channel_s channel[2];
+
+    u8 *compressed;
+    u32 block_index; // block currently in pcm, block_count if none
+    u32 block_pos;
+    u32 block_len;
+} Bcstm_s;
+
+// The stream is not closed with it
+Bcstm_s * bcstm_open(Stream_s *stream);
+void bcstm_close(Bcstm_s *bcstm);
+
+// Reads up to count stereo samples, returns how many were read (0 at the end)
+u32 bcstm_read(Bcstm_s *bcstm, s16 *out, u32 count);
+bool bcstm_seek(Bcstm_s *bcstm, u32 sample);
+
+#endif
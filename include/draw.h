@@ -112,6 +112,8 @@ typedef enum {
 
     TEXT_CONFIRM_YES_NO,
 
+    TEXT_LOADING_PREVIEW,
+
     TEXT_AMOUNT
 } Text;
 
@@ -160,6 +162,9 @@ void throw_error(char* error, ErrorLevel level);
 bool draw_confirm(const char* conf_msg, Entry_List_s* list);
 
 void draw_preview(C2D_Image preview, int preview_offset);
+#ifdef DEBUG_OVERLAY
+void draw_audio_stats(const audio_s * audio);
+#endif
 
 void draw_install(InstallType type);
 void draw_loading_bar(u32 current, u32 max, InstallType type);
@@ -0,0 +1,49 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#ifndef ETC1_H
+#define ETC1_H
+
+#include "common.h"
+
+// ETC1 stores each 4x4 block in 8 bytes, a quarter of RGB565 and an eighth of RGBA8
+#define ETC1_BLOCK_SIZE 8
+
+static inline u32 etc1_size(u32 width, u32 height)
+{
+    return width * height / 2;
+}
+
+// In a tiled texture, every 16 consecutive pixels make up one 4x4 block, in the
+// same order the GPU expects ETC1 blocks, so these work on any run of whole blocks.
+// src is tiled GPU_RGBA8 or GPU_RGB565, the decoder outputs tiled GPU_RGBA8.
+void etc1_encode(void * dst, const void * src, GPU_TEXCOLOR src_format, u32 blocks);
+void etc1_decode(void * dst, const void * src, u32 blocks);
+
+// Quality of an encoded texture compared to its source, in dB
+float etc1_psnr(const void * etc1, const void * src, GPU_TEXCOLOR src_format, u32 blocks);
+
+#endif
@@ -28,6 +28,76 @@
 #define FS_H
 
 #include "common.h"
+#include "hash.h"
+
+typedef struct {
+    u16 method;
+    u32 crc32;
+    u32 compressed_size;
+    u32 uncompressed_size;
+    u32 local_header_offset;
+    u64 mtime; // of the zip, only for zip64 ones: libarchive finds those and has no crc32 to give
+} Zip_Entry_s;
+
+#define STREAM_BUFFER_SIZE 0x4000
+// Reads of a hashed stream are hashed in pieces this big, while they're still in the cache
+#define STREAM_HASH_CHUNK 0x10000
+
+// Fingerprint of some data, worked out while it was read rather than in a pass of its own
+typedef struct {
+    u32 fast; // xxHash32
+    bool has_sha;
+    u8 sha[SHA256_SIZE];
+} File_Hash_s;
+
+typedef struct {
+    Xxh32_s fast;
+    Sha256_s sha;
+    bool with_sha;
+} File_Hasher_s;
+
+// Time spent getting data off the SD card and how much of it, for a zip member that's the
+// compressed bytes and whatever else reading it took was inflating
+typedef struct {
+    u64 ticks;
+    u64 bytes;
+} Read_Stats_s;
+
+struct archive;
+
+// Reads a file on the SD card, or a file inside a zip, a bit at a time
+typedef struct {
+    Handle handle;
+    struct archive *archive; // set for zip members
+
+    u16 zip_path[0x106];
+    char *file_name;
+
+    u64 size;
+    u64 offset;
+
+    char *buffer; // read-ahead for SD files, libarchive has its own for zips
+    u32 buffer_pos;
+    u32 buffer_len;
+
+    bool hashing; // everything read since stream_hash, until a seek
+    File_Hasher_s hasher;
+
+    char *spool; // what was inflated of a zip member so far, from stream_spool on
+    u64 spooled;
+
+    Read_Stats_s sd;
+} Stream_s;
+
+#define FILE_WRITE_CHUNK 0x40000
+
+// Writes a new file front to back. It is created at its final size and only flushed once, when closed.
+typedef struct {
+    Handle handle;
+    u64 size;
+    u64 offset;
+    u64 start;
+} File_Writer_s;
 
 extern FS_Archive ArchiveSD;
 extern FS_Archive ArchiveHomeExt;
@@ -35,14 +105,38 @@ extern FS_Archive ArchiveThemeExt;
 
 Result open_archives(void);
 Result close_archives(void);
+void lock_installed_files(void);
+void unlock_installed_files(void);
 
 u32 file_to_buf(FS_Path path, FS_Archive archive, char** buf);
 u32 zip_memory_to_buf(char *file_name, void * zip_memory, size_t zip_size, char ** buf);
 u32 zip_file_to_buf(char *file_name, u16 *zip_path, char **buf);
+u32 file_to_buf_hashed(FS_Path path, FS_Archive archive, char **buf, File_Hash_s *hash, bool with_sha);
+u32 zip_file_to_buf_hashed(char *file_name, u16 *zip_path, char **buf, File_Hash_s *hash, bool with_sha);
+bool zip_file_find_entry(char *file_name, u16 *zip_path, Zip_Entry_s *zip_entry);
+u64 file_mtime(u16 *path);
+
+Stream_s * stream_open_file(FS_Path path, FS_Archive archive);
+Stream_s * stream_open_zip(char *file_name, u16 *zip_path);
+size_t stream_read(Stream_s *stream, void *buf, size_t size);
+bool stream_seekable(const Stream_s *stream);
+bool stream_seek(Stream_s *stream, u64 offset);
+void stream_close(Stream_s *stream);
+bool stream_spool(Stream_s *stream, u64 max_size);
+void stream_hash(Stream_s *stream, bool with_sha);
+bool stream_hash_result(Stream_s *stream, File_Hash_s *hash);
+u32 stream_to_buf(Stream_s *stream, char **buf, File_Hash_s *hash, bool with_sha);
 u32 decompress_lz_file(FS_Path file_name, FS_Archive archive, char **buf);
 u32 compress_lz_file_fast(FS_Path path, FS_Archive archive, char *in_buf, u32 size);
 
-Result buf_to_file(u32 size, FS_Path path, FS_Archive archive, char *buf);
-void remake_file(FS_Path path, FS_Archive archive, u32 size);
+Result file_read_range(FS_Path path, FS_Archive archive, u32 offset, void *buf, u32 size);
+Result file_write_range(FS_Path path, FS_Archive archive, u32 offset, const void *buf, u32 size);
+u64 get_file_size(FS_Path path, FS_Archive archive);
+Result prepare_file(FS_Path path, FS_Archive archive, u64 size);
+Result file_writer_open(File_Writer_s *writer, FS_Path path, FS_Archive archive, u64 size);
+Result file_writer_write(File_Writer_s *writer, const void *buf, u32 size);
+Result file_writer_close(File_Writer_s *writer);
+Result write_new_file(FS_Path path, FS_Archive archive, const char *buf, u32 size);
+Result append_to_file(FS_Path path, FS_Archive archive, const char *buf, u32 size, u64 max_size);
 
 #endif
@@ -0,0 +1,62 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#ifndef HASH_H
+#define HASH_H
+
+#include "common.h"
+
+#define SHA256_SIZE (256/8)
+
+// SHA-256 done in this process, instead of one FS service call per buffer
+typedef struct {
+    u32 state[8];
+    u64 length;
+    u8 block[64];
+    u32 block_len;
+} Sha256_s;
+
+void sha256_init(Sha256_s * ctx);
+void sha256_update(Sha256_s * ctx, const void * data, size_t size);
+void sha256_final(Sha256_s * ctx, u8 * hash);
+void sha256(const void * data, size_t size, u8 * hash);
+
+// xxHash32: not cryptographic but several times faster, for telling files apart.
+// A match only says two files are probably the same, confirm with SHA-256 when it matters.
+typedef struct {
+    u32 v[4];
+    u32 seed;
+    u32 total_len;
+    u8 block[16];
+    u32 block_len;
+} Xxh32_s;
+
+void xxh32_init(Xxh32_s * ctx, u32 seed);
+void xxh32_update(Xxh32_s * ctx, const void * data, size_t size);
+u32 xxh32_final(const Xxh32_s * ctx);
+u32 xxh32(const void * data, size_t size, u32 seed);
+
+#endif
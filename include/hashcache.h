@@ -0,0 +1,79 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#ifndef HASHCACHE_H
+#define HASHCACHE_H
+
+#include "common.h"
+#include "loading.h"
+#include "fs.h"
+#include "hash.h"
+
+// Hashes of theme and splash files, kept across launches so finding out what's installed
+// doesn't mean reading and hashing every file again. The xxHash32 is always there and is
+// enough to rule a file out; the SHA-256 is only worked out to confirm a match.
+#define HASH_CACHE_PATH "/3ds/"  APP_TITLE  "/cache/hashes.bin"
+#define HASH_CACHE_MAGIC 0x32485348 // HSH2
+#define HASH_CACHE_ENTRIES 1024
+
+typedef struct {
+    u32 key;
+    u32 last_used;
+    bool extdata;
+    bool has_sha;
+    Data_Info_s info; // what the file looked like when it was hashed
+    u32 fast_hash;
+    u8 sha[SHA256_SIZE];
+} Hash_Cache_Entry_s;
+
+// FNV-1a of an entry's path and the name of one of its files
+u32 entry_key(const u16 * path, const char * filename);
+
+void init_hash_cache(void);
+void exit_hash_cache(void);
+void save_hash_cache(void);
+
+// The fast hash of a file of an entry, and its SHA-256 when sha isn't NULL.
+// Only read again when its size, crc32 or mtime changed.
+bool hash_data(char * filename, Entry_s entry, u32 * fast_hash, u8 * sha);
+// Same, with the info already looked up by get_data_info
+bool hash_data_info(char * filename, Entry_s entry, const Data_Info_s * info, u32 * fast_hash, u8 * sha);
+// A file on the SD card, by size and mtime the same way
+bool hash_sd_file(const char * path, u32 * fast_hash, u8 * sha);
+// size bytes at offset in a theme extdata file. There are no mtimes there, so it's trusted
+// for as long as the size in ThemeManage.bin stays the same, until hash_cache_forget_extdata,
+// and never past the current launch.
+bool hash_extdata(const char * path, u32 offset, u32 size, u32 * fast_hash, u8 * sha);
+// Hashes worked out while the data was being read for something else, like an install
+void hash_cache_put_data(char * filename, Entry_s entry, const Data_Info_s * info, const File_Hash_s * hash);
+void hash_cache_put_sd_file(const char * path, const File_Hash_s * hash);
+void hash_cache_put_extdata(const char * path, u32 offset, u32 size, const File_Hash_s * hash);
+void hash_cache_forget_extdata(void);
+// Changes every time the extdata is forgotten, which every theme install starts with
+u32 hash_cache_extdata_generation(void);
+void hash_cache_forget_sd_file(const char * path);
+
+#endif
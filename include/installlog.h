@@ -0,0 +1,59 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#ifndef INSTALLLOG_H
+#define INSTALLLOG_H
+
+#include "common.h"
+#include "fs.h"
+
+// Where the time of an install went, appended to a log so slow installs can be told apart by SD card
+#define INSTALL_LOG_PATH "/3ds/"  APP_TITLE  "/install.log"
+#define INSTALL_LOG_MAX_SIZE 0x10000
+
+typedef enum {
+    INSTALL_PHASE_SD_READ,
+    INSTALL_PHASE_INFLATE,
+    INSTALL_PHASE_LZ_DECODE,
+    INSTALL_PHASE_LZ_ENCODE,
+    INSTALL_PHASE_PREPARE, // creating or resizing files before they're written
+    INSTALL_PHASE_WRITE,
+    INSTALL_PHASE_FLUSH,
+    INSTALL_PHASE_METADATA, // ThemeManage.bin, SaveData.dat and the shuffle manifest
+
+    INSTALL_PHASE_AMOUNT
+} InstallPhase;
+
+typedef struct {
+    u64 ticks[INSTALL_PHASE_AMOUNT];
+    u64 bytes[INSTALL_PHASE_AMOUNT];
+} Install_Stats_s;
+
+void install_stats_add(Install_Stats_s * stats, InstallPhase phase, u64 start_tick, u64 bytes);
+void install_stats_add_stream(Install_Stats_s * stats, const Stream_s * stream, u64 read_ticks, u64 read_bytes);
+void log_install_stats(const Install_Stats_s * stats, const char * kind, int count, u64 total_ticks, Result res);
+
+#endif
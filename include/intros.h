@@ -0,0 +1,55 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#ifndef INTROS_H
+#define INTROS_H
+
+#include "common.h"
+#include "loading.h"
+
+// Decoded first seconds of recently played or neighbouring bgms, so a preview can start playing at once
+#define INTRO_MS 3000
+#define INTRO_CACHE_ENTRIES 8
+#define INTRO_CACHE_BUDGET (2*1024*1024)
+
+void init_intros(void);
+void exit_intros(void);
+
+// Decode the intros of the selected entry and the ones next to it in the background
+void intro_prefetch(Entry_List_s * list);
+void intro_cache_clear(void);
+
+// Gives the audio a copy of its cached intro, along with its rate and loop points
+bool intro_find(audio_s * audio);
+// Has the intro worker open the decoder of an audio playing its cached intro, ahead of any
+// prefetching. False when there's no worker to do it.
+bool intro_open_decoder(audio_s * audio);
+// Drops the audio's open request, or waits for the worker to be done with it
+void intro_cancel_open(audio_s * audio);
+// Takes ownership of pcm
+void intro_store(const u16 * path, u32 rate, ogg_int64_t loop_start, ogg_int64_t loop_end, s16 * pcm, u32 samples);
+
+#endif
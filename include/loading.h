@@ -104,6 +104,13 @@ typedef struct {
     char * tp_search;
 } Entry_List_s;
 
+// Identifies a file of a theme without reading it: the zip's crc32, or the SD file's mtime
+typedef struct {
+    u32 size;
+    u32 crc32;
+    u64 mtime;
+} Data_Info_s;
+
 typedef struct {
     void ** thread_arg;
     volatile bool run_thread;
@@ -118,13 +125,13 @@ void sort_by_filename(Entry_List_s * list);
 
 void delete_entry(Entry_s * entry, bool is_file);
 Result load_entries(const char * loading_path, Entry_List_s * list);
-bool load_preview_from_buffer(void * buf, u32 size, C2D_Image * preview_image, int * preview_offset);
-bool load_preview(Entry_List_s list, C2D_Image * preview_image, int * preview_offset);
-void free_preview(C2D_Image preview_image);
 Result load_audio(Entry_s, audio_s *);
 void load_icons_first(Entry_List_s * current_list, bool silent);
 void handle_scrolling(Entry_List_s * list);
 void load_icons_thread(void * void_arg);
 u32 load_data(char * filename, Entry_s entry, char ** buf);
+u32 load_data_hashed(char * filename, Entry_s entry, char ** buf, File_Hash_s * hash, bool with_sha);
+Stream_s * open_data_stream(char * filename, Entry_s entry);
+bool get_data_info(char * filename, Entry_s entry, Data_Info_s * info);
 
 #endif
\ No newline at end of file
@@ -30,25 +30,96 @@
 #include "common.h"
 #include "fs.h"
 #include "unicode.h"
+#include "bcstm.h"
 
 #include <tremor/ivorbisfile.h>
 #include <tremor/ivorbiscodec.h>
 
-#define BUF_TO_READ 40960 // How much data should be buffered at a time
+// How many wave buffers are decoded ahead of the one playing, and how long each one is.
+// More buffers ride out slower SD/zip reads (e.g. while icons load) at the cost of memory.
+#ifndef AUDIO_BUFFERS
+#define AUDIO_BUFFERS 8
+#endif
+#define AUDIO_BUFFER_MS 100
+
+// The audio thread decodes, seeks, and opens the decoder behind a cached intro (libarchive's zip
+// open, the BCSTM header, Tremor's headers), so it gets as much stack as the other workers doing that
+#define AUDIO_THREAD_STACK 0x10000
+// Decoded and thrown away at a time when seeking by decoding from the start
+#define AUDIO_SKIP_SIZE 0x1000
+// Zipped bgms up to this size are kept in memory once inflated, so looping back is a seek
+// instead of inflating and decoding everything before the loop start again
+#define AUDIO_SPOOL_MAX 0x400000
+
+// Per-call decode latency histogram, for the percentiles in the audio log
+#define AUDIO_LATENCY_BUCKETS 64
+#define AUDIO_LATENCY_STEP_US 100
+#define AUDIO_LOG_PATH "/3ds/"  APP_TITLE  "/audio.log"
+#define AUDIO_LOG_MAX_SIZE 0x10000
+#define AUDIO_LOG_LINE_SIZE 256
+
+typedef struct {
+    volatile u32 underruns; // times every queued buffer had played before the next one was ready
+    volatile u8 queued; // buffers waiting in ndsp, including the one playing
+    u8 min_queued;
+    u32 decoded;
+    u32 last_decode_us;
+    u32 worst_decode_us;
+
+    // Time spent in the decoder itself (ov_read or the bcstm reader), call by call
+    u32 decode_calls;
+    u64 decode_ticks;
+    u64 decoded_samples;
+    u32 latency[AUDIO_LATENCY_BUCKETS]; // the last bucket also holds everything slower
+} Audio_Stats_s;
 
 typedef struct {
+    u16 path[0x106]; // of the theme the bgm comes from
+    bool is_zip;
+    bool intro_only; // only the start is decoded, for the intro cache: not worth spooling
+    u32 rate;
+
+    bool decoder_open;
+    volatile bool decoder_busy; // being opened behind the cached intro, by the intro worker
     OggVorbis_File vf;
-    ndspWaveBuf wave_buf[2];
+    ndspWaveBuf wave_buf[AUDIO_BUFFERS];
     float mix[12];
     u8 buf_pos;
     long data_read;
-    char *filebuf;
-    u32 filesize;
+    Stream_s *stream;
+    Bcstm_s *bcstm; // set when playing bgm.bcstm because there is no bgm.ogg
+
+    // Looping, in samples. loop_end is 0 to loop at the end of the file.
+    // The first samples after loop_start are kept so the wrap doesn't have to wait on a seek.
+    ogg_int64_t loop_start;
+    ogg_int64_t loop_end;
+    ogg_int64_t position;
+    char *loop_head;
+    u32 loop_head_size;
+    u32 loop_head_len;
+    u32 loop_head_replay; // samples of the loop head still to be queued after a wrap
+
+    // The first seconds of the track: replayed from the intro cache while the
+    // decoder opens, or captured on the first play to fill it
+    s16 *intro;
+    u32 intro_size;
+    u32 intro_len;
+    u32 intro_pos;
+    bool intro_cached;
+
+    Audio_Stats_s stats;
     
     volatile bool stop;
+    LightEvent refill; // signalled from the ndsp frame callback when a buffer has finished playing
     Handle finished;
 } audio_s;
 
+bool open_audio_decoder(audio_s *);
+void open_audio_behind_intro(audio_s *);
+void close_audio_decoder(audio_s *);
+long decode_audio(audio_s *, char *, u32);
+bool seek_audio(audio_s *, ogg_int64_t);
+void init_audio_loop(audio_s *);
 void play_audio(audio_s *);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,94 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#ifndef PREVIEWS_H
+#define PREVIEWS_H
+
+#include "common.h"
+#include "loading.h"
+
+#define PREVIEW_TEX_SIZE 512
+#define PREVIEW_CACHE_ENTRIES 8
+#define PREVIEW_CACHE_BUDGET (4 * PREVIEW_TEX_SIZE*PREVIEW_TEX_SIZE*sizeof(u32))
+
+#define TEXTURE_CACHE_PATH "/3ds/"  APP_TITLE  "/cache/textures"
+#define TEXTURE_CACHE_MAGIC 0x58455441 // "ATEX"
+#define TEXTURE_CACHE_VERSION 2
+#define TEXTURE_CACHE_ENTRIES 128
+#define TEXTURE_CACHE_BUDGET (32*1024*1024)
+
+typedef enum {
+    PREVIEW_IDLE,
+    PREVIEW_LOADING,
+    PREVIEW_READY,
+    PREVIEW_NOT_FOUND,
+    PREVIEW_INVALID,
+} PreviewState;
+
+typedef struct {
+    u16 path[0x106];
+
+    int width;
+    int height;
+
+    GPU_TEXCOLOR format; // GPU_RGBA8, or GPU_ETC1 for opaque previews that went through the SD cache
+    void * data; // tiled, only the tile rows covering height are kept
+    u32 size;
+
+    u32 last_used;
+} Preview_s;
+
+// Header of the pre-tiled textures kept on the SD card, followed by the texture data.
+// The source fields identify the preview.png it was made from: crc32 and size from
+// the zip central directory for zips, size and modification time for folders.
+typedef struct {
+    u32 magic;
+    u32 version;
+
+    u16 path[0x106];
+    u32 source_size;
+    u32 source_crc32;
+    u64 source_mtime;
+
+    u16 width;
+    u16 height;
+    u32 format;
+    u32 data_size;
+} Texture_Cache_Header_s;
+
+void init_previews(void);
+void exit_previews(void);
+
+bool load_preview_from_buffer(void * buf, u32 size, C2D_Image * preview_image, int * preview_offset);
+bool load_preview(Entry_List_s list, C2D_Image * preview_image, int * preview_offset);
+bool update_preview(C2D_Image * preview_image, int * preview_offset);
+void cancel_preview(void);
+void free_preview(C2D_Image preview_image);
+
+void preview_prefetch(Entry_List_s * list);
+void preview_cache_clear(void);
+
+#endif
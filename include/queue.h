@@ -0,0 +1,91 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include "common.h"
+#include "loading.h"
+#include "draw.h"
+
+// Installs, deletions and downloads are done one after the other by a worker thread,
+// so the lists can still be browsed, and more operations queued, while they run
+#define OPERATION_QUEUE_SIZE 16
+// How long the summary of the last operation stays up once it's done
+#define OPERATION_SUMMARY_MS 5000
+
+typedef enum {
+    OPERATION_INSTALL_THEME,
+    OPERATION_INSTALL_NO_BGM,
+    OPERATION_INSTALL_BGM,
+    OPERATION_INSTALL_SHUFFLE,
+    OPERATION_INSTALL_SPLASH,
+    OPERATION_DELETE_SPLASH,
+    OPERATION_DELETE_ENTRY,
+    OPERATION_DOWNLOAD,
+
+    OPERATION_AMOUNT
+} OperationType;
+
+typedef struct {
+    OperationType type;
+    EntryMode mode;
+
+    // Copies, the lists can be reloaded while the operation waits its turn
+    Entry_s entry;
+    Entry_s * shuffle_entries; // owned by the operation
+    int shuffle_count;
+
+    // Filled in once it's done
+    Result result;
+    char * error; // what it would have shown with throw_error, shown once it's handed back
+    ErrorLevel error_level;
+} Operation_s;
+
+typedef struct {
+    OperationType type;
+    u32 progress;
+    u32 progress_max; // 0 when there's nothing to measure progress by
+    int queued; // waiting behind the running one
+} Operation_Status_s;
+
+extern const char * operation_names[OPERATION_AMOUNT];
+
+void init_operation_queue(void);
+void exit_operation_queue(void);
+
+bool queue_operation(Operation_s * operation);
+bool next_finished_operation(Operation_s * operation);
+void free_operation(Operation_s * operation);
+bool get_operation_status(Operation_Status_s * status);
+bool get_operation_summary(char * summary, size_t size);
+
+// Only do something when called from the worker, so the code the operations run can use them as it is
+void operation_progress(u32 current, u32 max);
+void operation_summary(const char * summary);
+bool defer_error(const char * error, ErrorLevel level);
+
+#endif
@@ -51,7 +51,8 @@
 
 #define CACHE_PATH_FORMAT            "/3ds/"  APP_TITLE  "/cache/%"  JSON_INTEGER_FORMAT
 
-bool themeplaza_browser(EntryMode mode);
+void themeplaza_browser(EntryMode mode);
+Result download_remote_entry(Entry_s * entry, EntryMode mode);
 u32 http_get(const char *url, char ** filename, char ** buf, InstallType install_type);
 
 #endif
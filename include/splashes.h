@@ -31,7 +31,7 @@
 #include "loading.h"
 
 void splash_delete(void);
-void splash_install(Entry_s splash);
+Result splash_install(Entry_s splash);
 
 void splash_check_installed(void * void_arg);
 
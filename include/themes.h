@@ -27,6 +27,8 @@
 #ifndef THEMES_H
 #define THEMES_H
 
+#include <stddef.h>
+
 #include "common.h"
 #include "loading.h"
 
@@ -69,6 +71,32 @@ typedef struct {
     u32 shuffle_music_sizes[MAX_SHUFFLE_THEMES];
 } ThemeManage_bin_s;
 
+// Only these fields are read and written, in place in the real files, so they have to sit at
+// the same offsets as they do there
+_Static_assert(sizeof(ThemeEntry_s) == 0x8, "ThemeEntry_s must be 8 bytes");
+_Static_assert(offsetof(SaveData_dat_s, theme_entry) == 0x13b8, "SaveData.dat theme entry moved");
+_Static_assert(offsetof(SaveData_dat_s, shuffle_themes) == 0x13c0, "SaveData.dat shuffle themes moved");
+_Static_assert(offsetof(SaveData_dat_s, shuffle) == 0x141b, "SaveData.dat shuffle flag moved");
+_Static_assert(offsetof(ThemeManage_bin_s, use_theme_cache) == 0x1c, "ThemeManage.bin header changed size");
+_Static_assert(offsetof(ThemeManage_bin_s, shuffle_body_sizes) == 0x338, "ThemeManage.bin shuffle body sizes moved");
+_Static_assert(offsetof(ThemeManage_bin_s, shuffle_music_sizes) == 0x360, "ThemeManage.bin shuffle music sizes moved");
+_Static_assert(sizeof(ThemeManage_bin_s) <= 0x800, "ThemeManage_bin_s bigger than ThemeManage.bin");
+
+#define SHUFFLE_MANIFEST_PATH "/3ds/"  APP_TITLE  "/cache/shuffle.bin"
+#define SHUFFLE_MANIFEST_MAGIC 0x33465348 // HSF3
+
+// What the last shuffle install put in each slot of the theme extdata caches.
+// Folder themes only have a size and an mtime to go by, so the entry's path is kept too.
+typedef struct {
+    u32 magic;
+    u32 body_sizes[MAX_SHUFFLE_THEMES];
+    u32 music_sizes[MAX_SHUFFLE_THEMES];
+    Data_Info_s body_sources[MAX_SHUFFLE_THEMES];
+    Data_Info_s music_sources[MAX_SHUFFLE_THEMES];
+    u32 body_keys[MAX_SHUFFLE_THEMES]; // entry_key of the file, 0 for an empty slot
+    u32 music_keys[MAX_SHUFFLE_THEMES];
+} Shuffle_Manifest_s;
+
 Result theme_install(Entry_s theme);
 Result no_bgm_install(Entry_s theme);
 Result bgm_install(Entry_s theme);
@@ -0,0 +1,49 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#ifndef TILING_H
+#define TILING_H
+
+#include "common.h"
+
+// Position of a pixel inside an 8x8 tile, split into its x and y contributions
+extern const u8 tile_morton_x[8];
+extern const u8 tile_morton_y[8];
+
+// Offset in pixels of (x, y) in a tiled texture that is tex_width pixels wide
+static inline u32 tile_offset(u32 x, u32 y, u32 tex_width)
+{
+    return ((((y >> 3) * (tex_width >> 3) + (x >> 3)) << 6) | tile_morton_x[x & 7] | tile_morton_y[y & 7]);
+}
+
+// Swizzle a linear image into the tiled layout the GPU samples from.
+// src_stride is in bytes, dst is the start of the texture data (or of a tile row)
+// and width/height don't need to be multiples of 8, partial tiles are handled.
+void tile_rgba8(void * dst, u32 tex_width, const void * src, u32 src_stride, u32 width, u32 height);
+void tile_rgb8(void * dst, u32 tex_width, const void * src, u32 src_stride, u32 width, u32 height);
+void tile_rgb565(void * dst, u32 tex_width, const void * src, u32 src_stride, u32 width, u32 height);
+
+#endif
@@ -0,0 +1,349 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#include "bcstm.h"
+
+#define BCSTM_INFO_BLOCK 0x4000
+#define BCSTM_SEEK_BLOCK 0x4001
+#define BCSTM_DATA_BLOCK 0x4002
+
+#define ADPCM_FRAME_SIZE 8
+#define ADPCM_FRAME_SAMPLES 14
+
+static const s8 nibble_values[16] = {
+    0, 1, 2, 3, 4, 5, 6, 7, -8, -7, -6, -5, -4, -3, -2, -1,
+};
+
+static inline u16 read16(const u8 *data)
+{
+    return data[0] | (data[1] << 8);
+}
+
+static inline u32 read32(const u8 *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((u32)data[3] << 24);
+}
+
+static inline s16 clamp16(s32 sample)
+{
+    if(sample > 0x7FFF) return 0x7FFF;
+    if(sample < -0x8000) return -0x8000;
+    return sample;
+}
+
+// References inside INFO are relative to the start of the table that holds them
+static const u8 * follow_reference(const u8 *base, const u8 *reference, const u8 *end, u32 size)
+{
+    s32 offset = read32(reference + 4);
+    if(offset < 0 || base + offset + size > end) return NULL;
+    return base + offset;
+}
+
+static inline s32 adpcm_sample(s32 nibble, s32 scale, s32 coef1, s32 coef2, s32 *hist1, s32 *hist2)
+{
+    s32 sample = clamp16((((nibble * scale) << 11) + 1024 + coef1 * *hist1 + coef2 * *hist2) >> 11);
+    *hist2 = *hist1;
+    *hist1 = sample;
+    return sample;
+}
+
+// Every frame is a header byte (predictor and scale) followed by 14 4-bit samples
+static void decode_adpcm(s16 *out, const u8 *in, u32 samples, Bcstm_Channel_s *channel)
+{
+    s32 hist1 = channel->yn1, hist2 = channel->yn2;
+
+    for(u32 done = 0; done < samples; in += ADPCM_FRAME_SIZE)
+    {
+        u8 header = in[0];
+        s32 scale = 1 << (header & 0xF);
+        // Only 8 predictors, the top bit of a corrupt header mustn't index past them
+        s32 coef1 = channel->coefs[((header >> 4) & 7) * 2];
+        s32 coef2 = channel->coefs[((header >> 4) & 7) * 2 + 1];
+
+        u32 count = samples - done < ADPCM_FRAME_SAMPLES ? samples - done : ADPCM_FRAME_SAMPLES;
+        const u8 *nibbles = in + 1;
+        u32 i = 0;
+        for(; i + 2 <= count; i += 2)
+        {
+            u8 byte = *nibbles++;
+            out[done++] = adpcm_sample(nibble_values[byte >> 4], scale, coef1, coef2, &hist1, &hist2);
+            out[done++] = adpcm_sample(nibble_values[byte & 0xF], scale, coef1, coef2, &hist1, &hist2);
+        }
+        if(i < count)
+            out[done++] = adpcm_sample(nibble_values[*nibbles >> 4], scale, coef1, coef2, &hist1, &hist2);
+    }
+
+    channel->yn1 = hist1;
+    channel->yn2 = hist2;
+}
+
+static bool load_block(Bcstm_s *bcstm, u32 block)
+{
+    bool last = block == bcstm->block_count - 1;
+    u32 stride = last ? bcstm->last_block_padded_size : bcstm->block_size;
+    u32 size = last ? bcstm->last_block_size : bcstm->block_size;
+    u32 samples = last ? bcstm->last_block_samples : bcstm->block_samples;
+    u32 offset = bcstm->data_offset + block * bcstm->block_size * bcstm->file_channels;
+
+    for(int c = 0; c < bcstm->channels; c++)
+    {
+        Bcstm_Channel_s *channel = &bcstm->channel[c];
+        if(!stream_seek(bcstm->stream, offset + c * stride) || stream_read(bcstm->stream, bcstm->compressed, size) != size)
+            return false;
+
+        switch(bcstm->encoding)
+        {
+            case BCSTM_DSP_ADPCM:
+                decode_adpcm(channel->pcm, bcstm->compressed, samples, channel);
+                break;
+            case BCSTM_PCM16:
+                memcpy(channel->pcm, bcstm->compressed, samples * sizeof(s16));
+                break;
+            case BCSTM_PCM8:
+                for(u32 i = 0; i < samples; i++)
+                    channel->pcm[i] = (s8)bcstm->compressed[i] << 8;
+                break;
+        }
+    }
+
+    bcstm->block_index = block;
+    bcstm->block_pos = 0;
+    bcstm->block_len = samples;
+    return true;
+}
+
+static bool parse_info(Bcstm_s *bcstm, const u8 *info, u32 info_size, u32 data_block)
+{
+    const u8 *end = info + info_size;
+    const u8 *base = info + 8;
+    if(info_size < 0x20 || memcmp(info, "INFO", 4)) return false;
+
+    const u8 *stream_info = follow_reference(base, base, end, 0x38);
+    const u8 *channel_table = follow_reference(base, base + 0x10, end, 4);
+    if(stream_info == NULL || channel_table == NULL) return false;
+
+    bcstm->encoding = stream_info[0];
+    bcstm->looping = stream_info[1];
+    bcstm->file_channels = stream_info[2];
+    bcstm->sample_rate = read32(stream_info + 0x04);
+    bcstm->loop_start = read32(stream_info + 0x08);
+    bcstm->sample_count = read32(stream_info + 0x0C);
+    bcstm->block_count = read32(stream_info + 0x10);
+    bcstm->block_size = read32(stream_info + 0x14);
+    bcstm->block_samples = read32(stream_info + 0x18);
+    bcstm->last_block_size = read32(stream_info + 0x1C);
+    bcstm->last_block_samples = read32(stream_info + 0x20);
+    bcstm->last_block_padded_size = read32(stream_info + 0x24);
+    bcstm->data_offset = data_block + 8 + read32(stream_info + 0x34);
+
+    if(bcstm->encoding > BCSTM_DSP_ADPCM || bcstm->file_channels == 0 || bcstm->block_count == 0 ||
+       bcstm->block_size == 0 || bcstm->last_block_size > bcstm->block_size ||
+       bcstm->block_samples == 0 || bcstm->last_block_samples > bcstm->block_samples)
+        return false;
+
+    bcstm->channels = bcstm->file_channels > 2 ? 2 : bcstm->file_channels;
+
+    if(bcstm->encoding == BCSTM_DSP_ADPCM)
+    {
+        if(read32(channel_table) < bcstm->channels) return false;
+        for(int c = 0; c < bcstm->channels; c++)
+        {
+            const u8 *channel_info = follow_reference(channel_table, channel_table + 4 + c * 8, end, 8);
+            const u8 *adpcm_info = channel_info ? follow_reference(channel_info, channel_info, end, 0x26) : NULL;
+            if(adpcm_info == NULL) return false;
+
+            for(int i = 0; i < 16; i++)
+                bcstm->channel[c].coefs[i] = read16(adpcm_info + i * 2);
+            bcstm->channel[c].start_yn1 = bcstm->channel[c].yn1 = read16(adpcm_info + 0x22);
+            bcstm->channel[c].start_yn2 = bcstm->channel[c].yn2 = read16(adpcm_info + 0x24);
+        }
+    }
+
+    return true;
+}
+
+Bcstm_s * bcstm_open(Stream_s *stream)
+{
+    u8 header[0x38];
+    if(stream_read(stream, header, sizeof(header)) != sizeof(header) || memcmp(header, "CSTM", 4) || read16(header + 4) != 0xFEFF)
+    {
+        DEBUG("<bcstm_open> Not a BCSTM\n");
+        return NULL;
+    }
+
+    u32 info_offset = 0, info_size = 0, seek_offset = 0, seek_size = 0, data_offset = 0;
+    u16 blocks = read16(header + 0x10);
+    for(u16 i = 0; i < blocks && i < 3; i++)
+    {
+        const u8 *reference = header + 0x14 + i * 12;
+        switch(read16(reference))
+        {
+            case BCSTM_INFO_BLOCK:
+                info_offset = read32(reference + 4);
+                info_size = read32(reference + 8);
+                break;
+            case BCSTM_SEEK_BLOCK:
+                seek_offset = read32(reference + 4);
+                seek_size = read32(reference + 8);
+                break;
+            case BCSTM_DATA_BLOCK:
+                data_offset = read32(reference + 4);
+                break;
+        }
+    }
+
+    if(info_offset == 0 || data_offset == 0 || info_size > 0x10000)
+    {
+        DEBUG("<bcstm_open> Missing blocks\n");
+        return NULL;
+    }
+
+    Bcstm_s *bcstm = calloc(1, sizeof(Bcstm_s));
+    bcstm->stream = stream;
+
+    u8 *info = malloc(info_size);
+    bool valid = stream_seek(stream, info_offset) && stream_read(stream, info, info_size) == info_size &&
+                 parse_info(bcstm, info, info_size, data_offset);
+    free(info);
+
+    if(!valid)
+    {
+        DEBUG("<bcstm_open> Invalid INFO block\n");
+        free(bcstm);
+        return NULL;
+    }
+
+    // Without the seek table, seeking decodes from the start
+    u32 table_size = bcstm->block_count * bcstm->file_channels * 2 * sizeof(s16);
+    if(bcstm->encoding == BCSTM_DSP_ADPCM && seek_offset && seek_size >= 8 + table_size)
+    {
+        bcstm->seek_table = malloc(table_size);
+        if(!stream_seek(stream, seek_offset + 8) || stream_read(stream, bcstm->seek_table, table_size) != table_size)
+        {
+            free(bcstm->seek_table);
+            bcstm->seek_table = NULL;
+        }
+    }
+
+    bcstm->compressed = malloc(bcstm->block_size);
+    for(int c = 0; c < bcstm->channels; c++)
+        bcstm->channel[c].pcm = malloc(bcstm->block_samples * sizeof(s16));
+    bcstm->block_index = bcstm->block_count;
+
+    DEBUG("<bcstm_open> %u channels, %lu Hz, encoding %d, loop %d from %lu to %lu\n", bcstm->file_channels,
+          bcstm->sample_rate, bcstm->encoding, bcstm->looping, bcstm->loop_start, bcstm->sample_count);
+
+    return bcstm;
+}
+
+void bcstm_close(Bcstm_s *bcstm)
+{
+    if(bcstm == NULL) return;
+
+    for(int c = 0; c < bcstm->channels; c++)
+        free(bcstm->channel[c].pcm);
+    free(bcstm->compressed);
+    free(bcstm->seek_table);
+    free(bcstm);
+}
+
+u32 bcstm_read(Bcstm_s *bcstm, s16 *out, u32 count)
+{
+    u32 done = 0;
+    while(done < count)
+    {
+        if(bcstm->block_index == bcstm->block_count || bcstm->block_pos == bcstm->block_len)
+        {
+            u32 next = bcstm->block_index == bcstm->block_count ? 0 : bcstm->block_index + 1;
+            if(next >= bcstm->block_count || !load_block(bcstm, next))
+                break;
+        }
+
+        u32 available = bcstm->block_len - bcstm->block_pos;
+        u32 to_copy = count - done < available ? count - done : available;
+        const s16 *left = bcstm->channel[0].pcm + bcstm->block_pos;
+        const s16 *right = bcstm->channel[bcstm->channels - 1].pcm + bcstm->block_pos;
+        for(u32 i = 0; i < to_copy; i++)
+        {
+            *out++ = left[i];
+            *out++ = right[i];
+        }
+
+        bcstm->block_pos += to_copy;
+        done += to_copy;
+    }
+
+    return done;
+}
+
+static void restore_start_history(Bcstm_s *bcstm)
+{
+    for(int c = 0; c < bcstm->channels; c++)
+    {
+        bcstm->channel[c].yn1 = bcstm->channel[c].start_yn1;
+        bcstm->channel[c].yn2 = bcstm->channel[c].start_yn2;
+    }
+}
+
+bool bcstm_seek(Bcstm_s *bcstm, u32 sample)
+{
+    if(sample >= bcstm->sample_count) return false;
+
+    u32 block = sample / bcstm->block_samples;
+    if(bcstm->encoding == BCSTM_DSP_ADPCM)
+    {
+        if(block == 0)
+        {
+            restore_start_history(bcstm);
+        }
+        else if(bcstm->seek_table != NULL)
+        {
+            for(int c = 0; c < bcstm->channels; c++)
+            {
+                bcstm->channel[c].yn1 = bcstm->seek_table[(block * bcstm->file_channels + c) * 2];
+                bcstm->channel[c].yn2 = bcstm->seek_table[(block * bcstm->file_channels + c) * 2 + 1];
+            }
+        }
+        else
+        {
+            // The history only comes from decoding everything before
+            u32 first = 0;
+            if(bcstm->block_index != bcstm->block_count && bcstm->block_index < block)
+                first = bcstm->block_index + 1;
+            else
+                restore_start_history(bcstm);
+
+            for(u32 b = first; b < block; b++)
+            {
+                if(!load_block(bcstm, b)) return false;
+            }
+        }
+    }
+
+    if(!load_block(bcstm, block)) return false;
+    bcstm->block_pos = sample % bcstm->block_samples;
+    return true;
+}
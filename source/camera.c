@@ -32,6 +32,7 @@
 #include "fs.h"
 #include "loading.h"
 #include "remote.h"
+#include "tiling.h"
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -134,17 +135,9 @@ void update_ui(void *arg)
     {
         draw_base_interface();
 
-        // Untiled texture loading code adapted from FBI
         svcWaitSynchronization(data->mutex, U64_MAX);
-        for(u32 x = 0; x < 400 && !data->finished; x++) {
-            for(u32 y = 0; y < 256 && !data->finished; y++) {
-                u32 dstPos = ((((y >> 3) * (512 >> 3) + (x >> 3)) << 6) + ((x & 1) | ((y & 1) << 1) | ((x & 2) << 1) | ((y & 2) << 2) | ((x & 4) << 2) | ((y & 4) << 3))) * sizeof(u16);
-                u32 srcPos = (y * 400 + x) * sizeof(u16);
-
-                memcpy(&((u8*) data->image.tex->data)[dstPos], &((u8*) data->camera_buffer)[srcPos], sizeof(u16));
-            }
-        }
-
+        if(!data->finished)
+            tile_rgb565(data->image.tex->data, 512, data->camera_buffer, 400 * sizeof(u16), 400, 240);
         svcReleaseMutex(data->mutex);
 
         if (data->finished)
@@ -282,8 +275,7 @@ void update_qr(qr_data *data)
                         if (extension == NULL || strcmp(extension, ".zip"))
                             strcat(path_to_file, ".zip");
 
-                        remake_file(fsMakePath(PATH_ASCII, path_to_file), ArchiveSD, zip_size);
-                        buf_to_file(zip_size, fsMakePath(PATH_ASCII, path_to_file), ArchiveSD, zip_buf);
+                        write_new_file(fsMakePath(PATH_ASCII, path_to_file), ArchiveSD, zip_buf, zip_size);
                         data->success = true;
                     }
                     else
@@ -27,6 +27,7 @@
 #include "draw.h"
 #include "unicode.h"
 #include "colors.h"
+#include "queue.h"
 
 #include "sprites.h"
 
@@ -105,6 +106,8 @@ void init_screens(void)
 
     C2D_TextParse(&text[TEXT_CONFIRM_YES_NO], staticBuf, "\uE000 Yes   \uE001 No");
 
+    C2D_TextParse(&text[TEXT_LOADING_PREVIEW], staticBuf, "Loading preview, please wait...");
+
     C2D_TextParse(&text[TEXT_INSTALL_LOADING_THEMES], staticBuf, "Loading themes, please wait...");
     C2D_TextParse(&text[TEXT_INSTALL_LOADING_SPLASHES], staticBuf, "Loading splashes, please wait...");
     C2D_TextParse(&text[TEXT_INSTALL_LOADING_ICONS], staticBuf, "Loading icons, please wait...");
@@ -265,6 +268,28 @@ void draw_base_interface(void)
         draw_image(sprites_charging_idx, 357, 2);
     #endif
 
+    // Whatever the operation worker is busy with, on every screen
+    Operation_Status_s status;
+    if(get_operation_status(&status))
+    {
+        char status_string[64] = {0};
+        int len = sprintf(status_string, "%s", operation_names[status.type]);
+        if(status.progress_max)
+            len += sprintf(status_string + len, " %lu%%", (u32)(100*(u64)status.progress/status.progress_max));
+        if(status.queued)
+            sprintf(status_string + len, " (+%i)", status.queued);
+        draw_text(70, 3, 0.5f, 0.5f, 0.5f, colors[COLOR_WHITE], status_string);
+
+        if(status.progress_max)
+            C2D_DrawRectSolid(0, 21, 0.5f, 400*(u64)status.progress/status.progress_max, 2, colors[COLOR_CURSOR]);
+    }
+    else
+    {
+        char summary[96];
+        if(get_operation_summary(summary, sizeof(summary)))
+            draw_text(70, 3, 0.5f, 0.5f, 0.5f, colors[COLOR_WHITE], summary);
+    }
+
     set_screen(bottom);
 
     C2D_DrawRectSolid(0, 0, 0.5f, 320, 24, colors[COLOR_ACCENT]);
@@ -293,6 +318,9 @@ void throw_error(char* error, ErrorLevel level)
             return;
     }
 
+    if(defer_error(error, level))
+        return;
+
     while(aptMainLoop())
     {
         hidScanInput();
@@ -331,11 +359,30 @@ void draw_preview(C2D_Image preview, int preview_offset)
 {
     start_frame();
     set_screen(top);
+    if(preview.tex == NULL)
+    {
+        draw_c2d_text_center(GFX_TOP, 110.0f, 0.5f, 0.6f, 0.6f, colors[COLOR_WHITE], &text[TEXT_LOADING_PREVIEW]);
+        return;
+    }
     C2D_DrawImageAt(preview, -preview_offset, 0, 0.5f, NULL, 1.0f, 1.0f);
     set_screen(bottom);
     C2D_DrawImageAt(preview, -(preview_offset+40), -240, 0.5f, NULL, 1.0f, 1.0f);
 }
 
+#ifdef DEBUG_OVERLAY
+void draw_audio_stats(const audio_s * audio)
+{
+    const Audio_Stats_s * stats = &audio->stats;
+    char info[0x80] = {0};
+    sprintf(info, "Audio: %u/%d queued (min %u), %lu underruns, decode %lu/%lu us",
+            stats->queued, AUDIO_BUFFERS, stats->min_queued, stats->underruns, stats->last_decode_us, stats->worst_decode_us);
+
+    set_screen(top);
+    C2D_DrawRectSolid(0, 226, 0.9f, 400, 14, colors[COLOR_BLACK]);
+    draw_text(2, 227, 0.9f, 0.4f, 0.4f, colors[COLOR_WHITE], info);
+}
+#endif
+
 static void draw_install_handler(InstallType type)
 {
     if(type != INSTALL_NONE)
@@ -0,0 +1,342 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#include "etc1.h"
+
+#include <math.h>
+
+static const int etc1_modifiers[8][2] = {
+    {  2,   8 },
+    {  5,  17 },
+    {  9,  29 },
+    { 13,  42 },
+    { 18,  60 },
+    { 24,  80 },
+    { 33, 106 },
+    { 47, 183 },
+};
+
+// ETC1 numbers pixels column by column, the tiled layout interleaves x and y bits
+static const u8 etc1_pixel_index[16] = {
+    0x0, 0x4, 0x1, 0x5, 0x8, 0xC, 0x9, 0xD,
+    0x2, 0x6, 0x3, 0x7, 0xA, 0xE, 0xB, 0xF,
+};
+
+typedef struct {
+    int r[16], g[16], b[16];
+} Etc1_Block_s;
+
+typedef struct {
+    int base[3];
+    int table;
+    u8 indexes[8];
+    u32 error;
+} Etc1_Subblock_s;
+
+static inline int clamp_u8(int value)
+{
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static inline int modifier_value(int table, int index)
+{
+    int value = etc1_modifiers[table][index & 1];
+    return (index & 2) ? -value : value;
+}
+
+static void load_block(Etc1_Block_s * block, const void * src, GPU_TEXCOLOR src_format)
+{
+    for(int i = 0; i < 16; i++)
+    {
+        int p = etc1_pixel_index[i];
+        if(src_format == GPU_RGB565)
+        {
+            u16 px = ((const u16 *)src)[i];
+            int r = (px >> 11) & 0x1F, g = (px >> 5) & 0x3F, b = px & 0x1F;
+            block->r[p] = (r << 3) | (r >> 2);
+            block->g[p] = (g << 2) | (g >> 4);
+            block->b[p] = (b << 3) | (b >> 2);
+        }
+        else
+        {
+            u32 px = ((const u32 *)src)[i];
+            block->r[p] = px >> 24;
+            block->g[p] = (px >> 16) & 0xFF;
+            block->b[p] = (px >> 8) & 0xFF;
+        }
+    }
+}
+
+static inline bool in_subblock(int p, int subblock, bool flip)
+{
+    return ((flip ? (p & 3) : p >> 2) >> 1) == subblock;
+}
+
+// The modifier is added to all three channels, so for a given base color only the
+// summed difference matters when picking it: minimise 3m^2 - 2m*d.
+// Clamping is ignored, which keeps this a few operations per pixel.
+static void fit_subblock(const Etc1_Block_s * block, int subblock, bool flip, Etc1_Subblock_s * out)
+{
+    int diffs[8];
+    u32 base_error = 0;
+    for(int p = 0, n = 0; p < 16; p++)
+    {
+        if(!in_subblock(p, subblock, flip)) continue;
+
+        int dr = block->r[p] - out->base[0];
+        int dg = block->g[p] - out->base[1];
+        int db = block->b[p] - out->base[2];
+        diffs[n++] = dr + dg + db;
+        base_error += dr*dr + dg*dg + db*db;
+    }
+
+    out->error = UINT32_MAX;
+    for(int table = 0; table < 8; table++)
+    {
+        int small = etc1_modifiers[table][0], large = etc1_modifiers[table][1];
+        int threshold = 3 * (small + large) / 2;
+        int error = 0;
+        u8 indexes[8];
+        for(int n = 0; n < 8; n++)
+        {
+            int d = abs(diffs[n]);
+            int index = d > threshold ? 1 : 0;
+            int m = index ? large : small;
+            error += 3*m*m - 2*m*d;
+            indexes[n] = index | (diffs[n] < 0 ? 2 : 0);
+        }
+
+        // Unclamped, this is still a sum of squares so it can't go below zero
+        u32 total = base_error + error;
+        if(total < out->error)
+        {
+            out->error = total;
+            out->table = table;
+            memcpy(out->indexes, indexes, sizeof(indexes));
+        }
+    }
+}
+
+static void average_subblock(const Etc1_Block_s * block, int subblock, bool flip, int average[3])
+{
+    int sum[3] = {0};
+    for(int p = 0; p < 16; p++)
+    {
+        if(!in_subblock(p, subblock, flip)) continue;
+        sum[0] += block->r[p];
+        sum[1] += block->g[p];
+        sum[2] += block->b[p];
+    }
+    for(int c = 0; c < 3; c++)
+        average[c] = (sum[c] + 4) / 8;
+}
+
+static u64 pack_block(const Etc1_Subblock_s subblocks[2], const int colors[2][3], bool differential, bool flip)
+{
+    u32 high = 0;
+    if(differential)
+    {
+        for(int c = 0; c < 3; c++)
+        {
+            int delta = colors[1][c] - colors[0][c];
+            high |= (colors[0][c] << (27 - 8*c)) | ((delta & 7) << (24 - 8*c));
+        }
+    }
+    else
+    {
+        for(int c = 0; c < 3; c++)
+            high |= (colors[0][c] << (28 - 8*c)) | (colors[1][c] << (24 - 8*c));
+    }
+    high |= (subblocks[0].table << 5) | (subblocks[1].table << 2) | (differential << 1) | flip;
+
+    u32 low = 0;
+    for(int s = 0; s < 2; s++)
+    {
+        for(int p = 0, n = 0; p < 16; p++)
+        {
+            if(!in_subblock(p, s, flip)) continue;
+            u8 index = subblocks[s].indexes[n++];
+            low |= ((index >> 1) << (16 + p)) | ((index & 1) << p);
+        }
+    }
+
+    return ((u64)high << 32) | low;
+}
+
+static u64 encode_block(const Etc1_Block_s * block)
+{
+    u64 best = 0;
+    u32 best_error = UINT32_MAX;
+
+    for(int flip = 0; flip < 2; flip++)
+    {
+        int averages[2][3];
+        average_subblock(block, 0, flip, averages[0]);
+        average_subblock(block, 1, flip, averages[1]);
+
+        for(int differential = 1; differential >= 0; differential--)
+        {
+            int colors[2][3];
+            Etc1_Subblock_s subblocks[2];
+            bool fits = true;
+            for(int s = 0; s < 2; s++)
+            {
+                for(int c = 0; c < 3; c++)
+                {
+                    if(differential)
+                    {
+                        colors[s][c] = (averages[s][c] * 31 + 127) / 255;
+                        subblocks[s].base[c] = (colors[s][c] << 3) | (colors[s][c] >> 2);
+                    }
+                    else
+                    {
+                        colors[s][c] = (averages[s][c] * 15 + 127) / 255;
+                        subblocks[s].base[c] = colors[s][c] * 0x11;
+                    }
+                }
+            }
+
+            if(differential)
+            {
+                for(int c = 0; c < 3; c++)
+                {
+                    int delta = colors[1][c] - colors[0][c];
+                    if(delta < -4 || delta > 3)
+                        fits = false;
+                }
+                if(!fits) continue;
+            }
+
+            fit_subblock(block, 0, flip, &subblocks[0]);
+            fit_subblock(block, 1, flip, &subblocks[1]);
+
+            u32 error = subblocks[0].error + subblocks[1].error;
+            if(error < best_error)
+            {
+                best_error = error;
+                best = pack_block(subblocks, (const int (*)[3])colors, differential, flip);
+            }
+        }
+    }
+
+    return best;
+}
+
+void etc1_encode(void * dst, const void * src, GPU_TEXCOLOR src_format, u32 blocks)
+{
+    const u32 block_bytes = 16 * (src_format == GPU_RGB565 ? sizeof(u16) : sizeof(u32));
+    const u8 * in = src;
+    u64 * out = dst;
+
+    Etc1_Block_s block;
+    for(u32 i = 0; i < blocks; i++, in += block_bytes)
+    {
+        load_block(&block, in, src_format);
+        out[i] = encode_block(&block);
+    }
+}
+
+static void decode_block(u64 data, Etc1_Block_s * block)
+{
+    u32 high = data >> 32, low = data;
+    bool flip = high & 1;
+    bool differential = high & 2;
+    int tables[2] = { (high >> 5) & 7, (high >> 2) & 7 };
+
+    int bases[2][3];
+    for(int c = 0; c < 3; c++)
+    {
+        if(differential)
+        {
+            int color = (high >> (27 - 8*c)) & 0x1F;
+            int delta = (high >> (24 - 8*c)) & 7;
+            if(delta & 4) delta -= 8;
+            int second = color + delta;
+            bases[0][c] = (color << 3) | (color >> 2);
+            bases[1][c] = (second << 3) | (second >> 2);
+        }
+        else
+        {
+            bases[0][c] = ((high >> (28 - 8*c)) & 0xF) * 0x11;
+            bases[1][c] = ((high >> (24 - 8*c)) & 0xF) * 0x11;
+        }
+    }
+
+    for(int p = 0; p < 16; p++)
+    {
+        int s = in_subblock(p, 1, flip);
+        int index = (((low >> (16 + p)) & 1) << 1) | ((low >> p) & 1);
+        int m = modifier_value(tables[s], index);
+        block->r[p] = clamp_u8(bases[s][0] + m);
+        block->g[p] = clamp_u8(bases[s][1] + m);
+        block->b[p] = clamp_u8(bases[s][2] + m);
+    }
+}
+
+void etc1_decode(void * dst, const void * src, u32 blocks)
+{
+    const u64 * in = src;
+    u32 * out = dst;
+
+    Etc1_Block_s block;
+    for(u32 i = 0; i < blocks; i++, out += 16)
+    {
+        decode_block(in[i], &block);
+        for(int j = 0; j < 16; j++)
+        {
+            int p = etc1_pixel_index[j];
+            out[j] = (block.r[p] << 24) | (block.g[p] << 16) | (block.b[p] << 8) | 0xFF;
+        }
+    }
+}
+
+float etc1_psnr(const void * etc1, const void * src, GPU_TEXCOLOR src_format, u32 blocks)
+{
+    const u32 block_bytes = 16 * (src_format == GPU_RGB565 ? sizeof(u16) : sizeof(u32));
+    const u64 * in = etc1;
+    const u8 * original = src;
+
+    u64 squared_error = 0;
+    Etc1_Block_s decoded, block;
+    for(u32 i = 0; i < blocks; i++, original += block_bytes)
+    {
+        decode_block(in[i], &decoded);
+        load_block(&block, original, src_format);
+        for(int p = 0; p < 16; p++)
+        {
+            int dr = decoded.r[p] - block.r[p];
+            int dg = decoded.g[p] - block.g[p];
+            int db = decoded.b[p] - block.b[p];
+            squared_error += dr*dr + dg*dg + db*db;
+        }
+    }
+
+    if(squared_error == 0)
+        return INFINITY;
+
+    double mse = (double)squared_error / (blocks * 16 * 3);
+    return 10.0 * log10(255.0 * 255.0 / mse);
+}
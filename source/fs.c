@@ -36,8 +36,11 @@ FS_Archive ArchiveSD;
 FS_Archive ArchiveHomeExt;
 FS_Archive ArchiveThemeExt;
 
+static Handle installed_files_mutex = 0;
+
 Result open_archives(void)
 {
+    svcCreateMutex(&installed_files_mutex, false);
     romfsInit();
     u8 regionCode;
     u32 archive1;
@@ -75,6 +78,7 @@ Result open_archives(void)
     FSUSER_CreateDirectory(ArchiveSD, fsMakePath(PATH_ASCII, "/3ds"), FS_ATTRIBUTE_DIRECTORY);
     FSUSER_CreateDirectory(ArchiveSD, fsMakePath(PATH_ASCII, "/3ds/"  APP_TITLE), FS_ATTRIBUTE_DIRECTORY);
     FSUSER_CreateDirectory(ArchiveSD, fsMakePath(PATH_ASCII, "/3ds/"  APP_TITLE  "/cache"), FS_ATTRIBUTE_DIRECTORY);
+    FSUSER_CreateDirectory(ArchiveSD, fsMakePath(PATH_ASCII, "/3ds/"  APP_TITLE  "/cache/textures"), FS_ATTRIBUTE_DIRECTORY);
 
     u32 homeMenuPath[3] = {MEDIATYPE_SD, archive2, 0};
     home.type = PATH_BINARY;
@@ -102,10 +106,24 @@ Result close_archives(void)
     if(R_FAILED(res = FSUSER_CloseArchive(ArchiveSD))) return res;
     if(R_FAILED(res = FSUSER_CloseArchive(ArchiveHomeExt))) return res;
     if(R_FAILED(res = FSUSER_CloseArchive(ArchiveThemeExt))) return res;
+    svcCloseHandle(installed_files_mutex);
 
     return 0;
 }
 
+// Held while the files the home menu and Luma read are written, or read to find out what's
+// installed: the theme extdata, SaveData.dat and the splashes. Installs run on the operation
+// worker and the checks on threads of their own, neither may see the other's half-written files.
+void lock_installed_files(void)
+{
+    svcWaitSynchronization(installed_files_mutex, U64_MAX);
+}
+
+void unlock_installed_files(void)
+{
+    svcReleaseMutex(installed_files_mutex);
+}
+
 u32 file_to_buf(FS_Path path, FS_Archive archive, char** buf)
 {
     Handle file;
@@ -123,19 +141,26 @@ u32 file_to_buf(FS_Path path, FS_Archive archive, char** buf)
     return (u32)size;
 }
 
-static u32 zip_to_buf(struct archive *a, char *file_name, char ** buf)
+// Moves the archive to the header of file_name, so its data is read next
+static bool zip_find(struct archive *a, char *file_name, struct archive_entry **entry)
 {
-    struct archive_entry *entry;
-
     bool found = false;
-    u64 file_size = 0;
 
-    while(!found && archive_read_next_header(a, &entry) == ARCHIVE_OK)
+    while(!found && archive_read_next_header(a, entry) == ARCHIVE_OK)
     {
-        found = !strcasecmp(archive_entry_pathname(entry), file_name);
+        found = !strcasecmp(archive_entry_pathname(*entry), file_name);
     }
 
-    if(found)
+    return found;
+}
+
+static u32 zip_to_buf(struct archive *a, char *file_name, char ** buf)
+{
+    struct archive_entry *entry;
+
+    u64 file_size = 0;
+
+    if(zip_find(a, file_name, &entry))
     {
         file_size = archive_entry_size(entry);
         *buf = calloc(file_size, sizeof(char));
@@ -166,34 +191,568 @@ u32 zip_memory_to_buf(char *file_name, void * zip_memory, size_t zip_size, char
     return zip_to_buf(a, file_name, buf);
 }
 
-u32 zip_file_to_buf(char *file_name, u16 *zip_path, char **buf)
+// libarchive reads zips on the SD card through these rather than stdio, so the time spent
+// reading can be told apart from the time spent inflating
+typedef struct {
+    Handle handle;
+    u64 size;
+    u64 offset;
+    Read_Stats_s *stats;
+    char buffer[0x4000];
+} Zip_Source_s;
+
+static la_ssize_t zip_source_read(struct archive *a, void *data, const void **buffer)
+{
+    (void)a;
+    Zip_Source_s *source = (Zip_Source_s *)data;
+    u64 start = svcGetSystemTick();
+    u32 read = 0;
+    if(R_FAILED(FSFILE_Read(source->handle, &read, source->offset, source->buffer, sizeof(source->buffer))))
+        return -1;
+    source->offset += read;
+    if(source->stats != NULL)
+    {
+        source->stats->ticks += svcGetSystemTick() - start;
+        source->stats->bytes += read;
+    }
+
+    *buffer = source->buffer;
+    return read;
+}
+
+static la_int64_t zip_source_seek(struct archive *a, void *data, la_int64_t offset, int whence)
+{
+    (void)a;
+    Zip_Source_s *source = (Zip_Source_s *)data;
+    s64 target = offset;
+    if(whence == SEEK_CUR)
+        target += source->offset;
+    else if(whence == SEEK_END)
+        target += source->size;
+    if(target < 0)
+        return ARCHIVE_FATAL;
+
+    source->offset = target;
+    return target;
+}
+
+static la_int64_t zip_source_skip(struct archive *a, void *data, la_int64_t request)
 {
-    ssize_t len = strulen(zip_path, 0x106);
-    char *path = calloc(sizeof(char), len*sizeof(u16));
-    utf16_to_utf8((u8*)path, zip_path, len*sizeof(u16));
+    (void)a;
+    Zip_Source_s *source = (Zip_Source_s *)data;
+    if(source->offset + request > source->size)
+        request = source->size - source->offset;
+
+    source->offset += request;
+    return request;
+}
+
+static int zip_source_close(struct archive *a, void *data)
+{
+    (void)a;
+    Zip_Source_s *source = (Zip_Source_s *)data;
+    FSFILE_Close(source->handle);
+    free(source);
+    return ARCHIVE_OK;
+}
+
+static struct archive * zip_open(u16 *zip_path, Read_Stats_s *stats)
+{
+    Handle handle;
+    if(R_FAILED(FSUSER_OpenFile(&handle, ArchiveSD, fsMakePath(PATH_UTF16, zip_path), FS_OPEN_READ, 0)))
+    {
+        DEBUG("Couldn't open zip\n");
+        return NULL;
+    }
+
+    Zip_Source_s *source = calloc(1, sizeof(Zip_Source_s));
+    source->handle = handle;
+    source->stats = stats;
+    FSFILE_GetSize(handle, &source->size);
 
     struct archive *a = archive_read_new();
     archive_read_support_format_zip(a);
+    archive_read_set_read_callback(a, zip_source_read);
+    archive_read_set_seek_callback(a, zip_source_seek);
+    archive_read_set_skip_callback(a, zip_source_skip);
+    archive_read_set_close_callback(a, zip_source_close); // frees the source from here on
+    archive_read_set_callback_data(a, source);
 
-    int r = archive_read_open_filename(a, path, 0x4000);
-    free(path);
-    if(r != ARCHIVE_OK)
+    if(archive_read_open1(a) != ARCHIVE_OK)
     {
         DEBUG("Invalid zip being opened\n");
-        return 0;
+        archive_read_free(a);
+        return NULL;
     }
 
+    return a;
+}
+
+u32 zip_file_to_buf(char *file_name, u16 *zip_path, char **buf)
+{
+    struct archive *a = zip_open(zip_path, NULL);
+    if(a == NULL) return 0;
+
     return zip_to_buf(a, file_name, buf);
 }
 
-Result buf_to_file(u32 size, FS_Path path, FS_Archive archive, char *buf)
+u32 file_to_buf_hashed(FS_Path path, FS_Archive archive, char **buf, File_Hash_s *hash, bool with_sha)
+{
+    Stream_s *stream = stream_open_file(path, archive);
+    if(stream == NULL) return 0;
+
+    u32 size = stream_to_buf(stream, buf, hash, with_sha);
+    stream_close(stream);
+    return size;
+}
+
+// Inflated and hashed in the same pass
+u32 zip_file_to_buf_hashed(char *file_name, u16 *zip_path, char **buf, File_Hash_s *hash, bool with_sha)
+{
+    Stream_s *stream = stream_open_zip(file_name, zip_path);
+    if(stream == NULL) return 0;
+
+    u32 size = stream_to_buf(stream, buf, hash, with_sha);
+    stream_close(stream);
+    return size;
+}
+
+Stream_s * stream_open_file(FS_Path path, FS_Archive archive)
+{
+    Handle handle;
+    if(R_FAILED(FSUSER_OpenFile(&handle, archive, path, FS_OPEN_READ, 0))) return NULL;
+
+    Stream_s *stream = calloc(1, sizeof(Stream_s));
+    stream->handle = handle;
+    FSFILE_GetSize(handle, &stream->size);
+    stream->buffer = malloc(STREAM_BUFFER_SIZE);
+
+    return stream;
+}
+
+static bool stream_open_zip_member(Stream_s *stream)
+{
+    stream->archive = zip_open(stream->zip_path, &stream->sd);
+    if(stream->archive == NULL) return false;
+
+    struct archive_entry *entry;
+    if(!zip_find(stream->archive, stream->file_name, &entry))
+    {
+        archive_read_free(stream->archive);
+        stream->archive = NULL;
+        return false;
+    }
+
+    stream->size = archive_entry_size(entry);
+    stream->offset = 0;
+    return true;
+}
+
+Stream_s * stream_open_zip(char *file_name, u16 *zip_path)
+{
+    Stream_s *stream = calloc(1, sizeof(Stream_s));
+    memcpy(stream->zip_path, zip_path, 0x106*sizeof(u16));
+    stream->file_name = strdup(file_name);
+
+    if(!stream_open_zip_member(stream))
+    {
+        DEBUG("<stream_open_zip> Couldn't find %s in zip\n", file_name);
+        stream_close(stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+static void file_hasher_init(File_Hasher_s *hasher, bool with_sha)
+{
+    xxh32_init(&hasher->fast, 0);
+    hasher->with_sha = with_sha;
+    if(with_sha)
+        sha256_init(&hasher->sha);
+}
+
+static void file_hasher_update(File_Hasher_s *hasher, const void *data, size_t size)
+{
+    xxh32_update(&hasher->fast, data, size);
+    if(hasher->with_sha)
+        sha256_update(&hasher->sha, data, size);
+}
+
+static void file_hasher_final(File_Hasher_s *hasher, File_Hash_s *hash)
+{
+    hash->fast = xxh32_final(&hasher->fast);
+    hash->has_sha = hasher->with_sha;
+    if(hasher->with_sha)
+        sha256_final(&hasher->sha, hash->sha);
+    else
+        memset(hash->sha, 0, SHA256_SIZE);
+}
+
+size_t stream_read(Stream_s *stream, void *buf, size_t size)
+{
+    size_t done = 0;
+
+    if(stream->archive != NULL)
+    {
+        // Whatever was inflated before comes back out of the spool
+        if(stream->spool != NULL && stream->offset < stream->spooled)
+        {
+            u64 available = stream->spooled - stream->offset;
+            done = size < available ? size : available;
+            memcpy(buf, stream->spool + stream->offset, done);
+            if(stream->hashing)
+                file_hasher_update(&stream->hasher, buf, done);
+        }
+
+        // libarchive already reads the zip in blocks, no need for another buffer
+        while(done < size)
+        {
+            ssize_t read = archive_read_data(stream->archive, (char *)buf + done, size - done);
+            if(read <= 0) break;
+            if(stream->hashing)
+                file_hasher_update(&stream->hasher, (char *)buf + done, read);
+            if(stream->spool != NULL)
+            {
+                if(stream->spooled + read <= stream->size)
+                {
+                    memcpy(stream->spool + stream->spooled, (char *)buf + done, read);
+                    stream->spooled += read;
+                }
+                else
+                {
+                    // More than the zip said there was, it can't be trusted to fit
+                    free(stream->spool);
+                    stream->spool = NULL;
+                }
+            }
+            done += read;
+        }
+        stream->offset += done;
+        return done;
+    }
+
+    while(done < size)
+    {
+        if(stream->buffer_pos == stream->buffer_len)
+        {
+            u32 read = 0;
+            // Big reads skip the buffer entirely
+            if(size - done >= STREAM_BUFFER_SIZE)
+            {
+                u32 wanted = size - done;
+                if(stream->hashing && wanted > STREAM_HASH_CHUNK)
+                    wanted = STREAM_HASH_CHUNK;
+                u64 start = svcGetSystemTick();
+                FSFILE_Read(stream->handle, &read, stream->offset, (char *)buf + done, wanted);
+                stream->sd.ticks += svcGetSystemTick() - start;
+                stream->sd.bytes += read;
+                if(read == 0) break;
+                if(stream->hashing)
+                    file_hasher_update(&stream->hasher, (char *)buf + done, read);
+                done += read;
+                stream->offset += read;
+                stream->buffer_pos = stream->buffer_len = 0;
+                continue;
+            }
+
+            u64 start = svcGetSystemTick();
+            FSFILE_Read(stream->handle, &read, stream->offset, stream->buffer, STREAM_BUFFER_SIZE);
+            stream->sd.ticks += svcGetSystemTick() - start;
+            stream->sd.bytes += read;
+            if(read == 0) break;
+            stream->buffer_pos = 0;
+            stream->buffer_len = read;
+        }
+
+        u32 available = stream->buffer_len - stream->buffer_pos;
+        u32 to_copy = size - done < available ? size - done : available;
+        memcpy((char *)buf + done, stream->buffer + stream->buffer_pos, to_copy);
+        if(stream->hashing)
+            file_hasher_update(&stream->hasher, (char *)buf + done, to_copy);
+        stream->buffer_pos += to_copy;
+        stream->offset += to_copy;
+        done += to_copy;
+    }
+
+    return done;
+}
+
+// A spooled zip member is, once all of it has been inflated
+bool stream_seekable(const Stream_s *stream)
+{
+    return stream->archive == NULL || (stream->spool != NULL && stream->spooled == stream->size);
+}
+
+// Keeps everything inflated from a zip member in memory from here on, so going back is a memcpy
+// instead of inflating it all again. Only for members still at the start and at most max_size big.
+bool stream_spool(Stream_s *stream, u64 max_size)
+{
+    if(stream->archive == NULL || stream->spool != NULL) return true;
+    if(stream->offset != 0 || stream->size == 0 || stream->size > max_size) return false;
+
+    stream->spool = malloc(stream->size);
+    stream->spooled = 0;
+    return stream->spool != NULL;
+}
+
+// Zip members can't seek backwards unless they're spooled: they are reopened and skipped forward
+// instead, which is fine to go back to the start but too slow for anything else
+bool stream_seek(Stream_s *stream, u64 offset)
+{
+    if(offset > stream->size) return false;
+    if(offset != stream->offset) stream->hashing = false;
+
+    if(stream->archive == NULL)
+    {
+        // Stay in the read-ahead buffer if we can
+        u64 buffer_start = stream->offset - stream->buffer_pos;
+        if(offset >= buffer_start && offset <= buffer_start + stream->buffer_len)
+        {
+            stream->buffer_pos = offset - buffer_start;
+        }
+        else
+        {
+            stream->buffer_pos = stream->buffer_len = 0;
+        }
+        stream->offset = offset;
+        return true;
+    }
+
+    if(stream->spool != NULL && offset <= stream->spooled)
+    {
+        stream->offset = offset;
+        return true;
+    }
+
+    if(offset < stream->offset)
+    {
+        archive_read_free(stream->archive);
+        if(!stream_open_zip_member(stream)) return false;
+    }
+
+    char skip[0x400];
+    while(stream->offset < offset)
+    {
+        u64 left = offset - stream->offset;
+        if(stream_read(stream, skip, left < sizeof(skip) ? left : sizeof(skip)) == 0)
+            return false;
+    }
+
+    return true;
+}
+
+void stream_close(Stream_s *stream)
+{
+    if(stream == NULL) return;
+
+    if(stream->archive != NULL)
+        archive_read_free(stream->archive);
+    else if(stream->handle)
+        FSFILE_Close(stream->handle);
+
+    free(stream->file_name);
+    free(stream->buffer);
+    free(stream->spool);
+    free(stream);
+}
+
+// Hashes everything read from here on, as it's read
+void stream_hash(Stream_s *stream, bool with_sha)
+{
+    file_hasher_init(&stream->hasher, with_sha);
+    stream->hashing = true;
+}
+
+// False if the stream seeked since stream_hash, the hash would be of the wrong data
+bool stream_hash_result(Stream_s *stream, File_Hash_s *hash)
+{
+    if(!stream->hashing) return false;
+
+    file_hasher_final(&stream->hasher, hash);
+    stream->hashing = false;
+    return true;
+}
+
+// Reads what's left of a stream into a new buffer, hashing it along the way when hash isn't NULL
+u32 stream_to_buf(Stream_s *stream, char **buf, File_Hash_s *hash, bool with_sha)
+{
+    u32 size = stream->size - stream->offset;
+    if(size == 0) return 0;
+
+    if(hash != NULL)
+        stream_hash(stream, with_sha);
+
+    *buf = calloc(1, size);
+    u32 read = stream_read(stream, *buf, size);
+    if(read != size)
+    {
+        DEBUG("<stream_to_buf> Read %lu bytes of %lu\n", read, size);
+        free(*buf);
+        *buf = NULL;
+        return 0;
+    }
+
+    if(hash != NULL)
+        stream_hash_result(stream, hash);
+    return size;
+}
+
+// Zip64 central directories aren't parsed below, the local headers are walked by libarchive instead
+static bool zip_scan_entry(char *file_name, u16 *zip_path, Zip_Entry_s *zip_entry)
+{
+    struct archive *a = zip_open(zip_path, NULL);
+    if(a == NULL) return false;
+
+    struct archive_entry *entry;
+    bool found = zip_find(a, file_name, &entry);
+    if(found)
+    {
+        zip_entry->uncompressed_size = archive_entry_size(entry);
+        zip_entry->mtime = file_mtime(zip_path);
+    }
+
+    archive_read_free(a);
+    return found;
+}
+
+// Looks up a file in the zip central directory, without reading or inflating it
+bool zip_file_find_entry(char *file_name, u16 *zip_path, Zip_Entry_s *zip_entry)
+{
+    memset(zip_entry, 0, sizeof(Zip_Entry_s));
+
+    Handle handle;
+    if(R_FAILED(FSUSER_OpenFile(&handle, ArchiveSD, fsMakePath(PATH_UTF16, zip_path), FS_OPEN_READ, 0))) return false;
+
+    u64 size;
+    FSFILE_GetSize(handle, &size);
+
+    // The end of central directory record is at most 0xFFFF bytes (the comment) from the end
+    u32 tail_size = size < 0xFFFF + 22 ? (u32)size : 0xFFFF + 22;
+    u8 *tail = malloc(tail_size);
+    if(tail == NULL)
+    {
+        FSFILE_Close(handle);
+        return false;
+    }
+    u32 read = 0;
+    if(R_FAILED(FSFILE_Read(handle, &read, size - tail_size, tail, tail_size)))
+        read = 0;
+
+    s64 eocd = -1;
+    for(s64 i = (s64)read - 22; i >= 0 && eocd < 0; i--)
+    {
+        if(tail[i] == 'P' && tail[i+1] == 'K' && tail[i+2] == 5 && tail[i+3] == 6)
+            eocd = i;
+    }
+
+    #define READ16(p) ((p)[0] | ((p)[1] << 8))
+    #define READ32(p) ((u32)(p)[0] | ((u32)(p)[1] << 8) | ((u32)(p)[2] << 16) | ((u32)(p)[3] << 24))
+
+    bool found = false;
+    bool zip64 = false;
+    if(eocd >= 0)
+    {
+        u16 entries = READ16(tail + eocd + 10);
+        u32 cd_size = READ32(tail + eocd + 12);
+        u32 cd_offset = READ32(tail + eocd + 16);
+
+        // Saturated fields, or a zip64 locator right before the record, mean the real values are elsewhere
+        zip64 = entries == 0xFFFF || cd_size == 0xFFFFFFFF || cd_offset == 0xFFFFFFFF ||
+                (eocd >= 20 && READ32(tail + eocd - 20) == 0x07064b50);
+
+        u8 *cd = NULL;
+        u32 cd_read = 0;
+        if(!zip64 && (u64)cd_offset + cd_size <= size && (cd = malloc(cd_size)) != NULL)
+        {
+            if(R_FAILED(FSFILE_Read(handle, &cd_read, cd_offset, cd, cd_size)) || cd_read != cd_size)
+                cd_read = 0;
+        }
+        else if(!zip64)
+        {
+            DEBUG("<zip_file_find_entry> Bad central directory: %lu bytes at %lu\n", cd_size, cd_offset);
+        }
+
+        size_t name_len = strlen(file_name);
+        u32 pos = 0;
+        for(u16 i = 0; i < entries && !found && pos + 46 <= cd_read; i++)
+        {
+            u8 *header = cd + pos;
+            if(READ32(header) != 0x02014b50) break;
+
+            u16 entry_name_len = READ16(header + 28);
+            u16 extra_len = READ16(header + 30);
+            u16 comment_len = READ16(header + 32);
+
+            if(entry_name_len == name_len && pos + 46 + name_len <= cd_read && !strncasecmp((char *)header + 46, file_name, name_len))
+            {
+                zip_entry->method = READ16(header + 10);
+                zip_entry->crc32 = READ32(header + 16);
+                zip_entry->compressed_size = READ32(header + 20);
+                zip_entry->uncompressed_size = READ32(header + 24);
+                zip_entry->local_header_offset = READ32(header + 42);
+                found = true;
+            }
+
+            pos += 46 + entry_name_len + extra_len + comment_len;
+        }
+
+        free(cd);
+    }
+
+    #undef READ16
+    #undef READ32
+
+    free(tail);
+    FSFILE_Close(handle);
+
+    if(zip64)
+        return zip_scan_entry(file_name, zip_path, zip_entry);
+    return found;
+}
+
+u64 file_mtime(u16 *path)
+{
+    ssize_t len = strulen(path, 0x106);
+    char *utf8_path = calloc(sizeof(char), len*sizeof(u16) + sizeof("sdmc:"));
+    strcpy(utf8_path, "sdmc:");
+    utf16_to_utf8((u8*)utf8_path + strlen("sdmc:"), path, len*sizeof(u16));
+
+    u64 mtime = 0;
+    sdmc_getmtime(utf8_path, &mtime);
+    free(utf8_path);
+
+    return mtime;
+}
+
+// Only size bytes at offset are read, for files of which a few fields are needed
+Result file_read_range(FS_Path path, FS_Archive archive, u32 offset, void *buf, u32 size)
 {
     Handle handle;
     Result res = 0;
-    if (R_FAILED(res = FSUSER_OpenFile(&handle, archive, path, FS_OPEN_WRITE, 0))) return res;
-    if (R_FAILED(res = FSFILE_Write(handle, NULL, 0, buf, size, FS_WRITE_FLUSH))) return res;
-    if (R_FAILED(res = FSFILE_Close(handle))) return res;
-    return 0;
+    if(R_FAILED(res = FSUSER_OpenFile(&handle, archive, path, FS_OPEN_READ, 0))) return res;
+
+    u32 read = 0;
+    res = FSFILE_Read(handle, &read, offset, buf, size);
+    FSFILE_Close(handle);
+    if(R_SUCCEEDED(res) && read != size)
+        res = MAKERESULT(RL_PERMANENT, RS_CANCELED, RM_APPLICATION, RD_NO_DATA);
+    return res;
+}
+
+// Overwrites size bytes at offset of an existing file, leaving the rest of it as it was
+Result file_write_range(FS_Path path, FS_Archive archive, u32 offset, const void *buf, u32 size)
+{
+    Handle handle;
+    Result res = 0;
+    if(R_FAILED(res = FSUSER_OpenFile(&handle, archive, path, FS_OPEN_WRITE, 0))) return res;
+
+    u32 written = 0;
+    res = FSFILE_Write(handle, &written, offset, buf, size, FS_WRITE_FLUSH);
+    FSFILE_Close(handle);
+    if(R_SUCCEEDED(res) && written != size)
+        res = MAKERESULT(RL_PERMANENT, RS_CANCELED, RM_APPLICATION, RD_NO_DATA);
+    return res;
 }
 
 u32 decompress_lz_file(FS_Path file_name, FS_Archive archive, char **buf)
@@ -332,22 +891,119 @@ u32 compress_lz_file_fast(FS_Path path, FS_Archive archive, char *in_buf, u32 si
         if (++counter == 8) counter = 0;
     }
 
-    buf_to_file(output_size, path, archive, output_buf);
+    file_write_range(path, archive, 0, output_buf, output_size);
     free(output_buf);
 
     return output_size;
 }
 
-void remake_file(FS_Path path, FS_Archive archive, u32 size)
+// 0 if the file doesn't exist
+u64 get_file_size(FS_Path path, FS_Archive archive)
 {
     Handle handle;
-    if (R_SUCCEEDED(FSUSER_OpenFile(&handle, archive, path, FS_OPEN_READ, 0)))
+    u64 size = 0;
+    if (R_FAILED(FSUSER_OpenFile(&handle, archive, path, FS_OPEN_READ, 0))) return 0;
+    FSFILE_GetSize(handle, &size);
+    FSFILE_Close(handle);
+    return size;
+}
+
+// Makes sure the file exists with the given size, keeping its contents if it already does.
+// For files only read up to a length stored elsewhere, so the rest never needs writing.
+Result prepare_file(FS_Path path, FS_Archive archive, u64 size)
+{
+    u64 current_size = get_file_size(path, archive);
+    if (current_size == size) return 0;
+    FSUSER_DeleteFile(archive, path);
+    return FSUSER_CreateFile(archive, path, 0, size);
+}
+
+static u64 writer_total_bytes = 0;
+static u64 writer_total_ticks = 0;
+
+// Replaces the file with an empty one of the final size; nothing is written until the content itself
+Result file_writer_open(File_Writer_s *writer, FS_Path path, FS_Archive archive, u64 size)
+{
+    Result res = 0;
+    writer->handle = 0;
+    writer->size = size;
+    writer->offset = 0;
+    writer->start = svcGetSystemTick();
+
+    FSUSER_DeleteFile(archive, path);
+    if (R_FAILED(res = FSUSER_CreateFile(archive, path, 0, size))) return res;
+    return FSUSER_OpenFile(&writer->handle, archive, path, FS_OPEN_WRITE, 0);
+}
+
+Result file_writer_write(File_Writer_s *writer, const void *buf, u32 size)
+{
+    Result res = 0;
+    const char *data = buf;
+    while (size)
     {
-        FSFILE_Close(handle);
-        FSUSER_DeleteFile(archive, path);
+        u32 chunk = size < FILE_WRITE_CHUNK ? size : FILE_WRITE_CHUNK;
+        u32 written = 0;
+        if (R_FAILED(res = FSFILE_Write(writer->handle, &written, writer->offset, data, chunk, 0))) return res;
+        if (written != chunk) return MAKERESULT(RL_PERMANENT, RS_OUTOFRESOURCE, RM_APPLICATION, RD_TOO_LARGE);
+
+        writer->offset += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+Result file_writer_close(File_Writer_s *writer)
+{
+    if (!writer->handle) return MAKERESULT(RL_PERMANENT, RS_INVALIDSTATE, RM_APPLICATION, RD_INVALID_HANDLE);
+
+    Result res = FSFILE_Flush(writer->handle);
+    Result close_res = FSFILE_Close(writer->handle);
+    writer->handle = 0;
+
+    u64 ticks = svcGetSystemTick() - writer->start;
+    writer_total_bytes += writer->offset;
+    writer_total_ticks += ticks;
+    DEBUG("<file_writer_close> %llu bytes in %llu ms, %llu bytes in %llu ms since launch\n", writer->offset,
+          ticks / (SYSCLOCK_ARM11 / 1000), writer_total_bytes, writer_total_ticks / (SYSCLOCK_ARM11 / 1000));
+
+    if (R_FAILED(res)) return res;
+    if (R_FAILED(close_res)) return close_res;
+    if (writer->offset != writer->size) return MAKERESULT(RL_PERMANENT, RS_INVALIDSTATE, RM_APPLICATION, RD_INVALID_SIZE);
+    return 0;
+}
+
+Result write_new_file(FS_Path path, FS_Archive archive, const char *buf, u32 size)
+{
+    File_Writer_s writer;
+    Result res = file_writer_open(&writer, path, archive, size);
+    if (R_SUCCEEDED(res)) res = file_writer_write(&writer, buf, size);
+    if (writer.handle)
+    {
+        Result close_res = file_writer_close(&writer);
+        if (R_SUCCEEDED(res)) res = close_res;
+    }
+    return res;
+}
+
+// Adds to the end of the file, creating it if needed. Once it has grown past
+// max_size it is started over, so logs can't fill up the SD card.
+Result append_to_file(FS_Path path, FS_Archive archive, const char *buf, u32 size, u64 max_size)
+{
+    Handle handle;
+    Result res = 0;
+    if (R_FAILED(res = FSUSER_OpenFile(&handle, archive, path, FS_OPEN_WRITE | FS_OPEN_CREATE, 0))) return res;
+
+    u64 offset = 0;
+    FSFILE_GetSize(handle, &offset);
+    if (offset + size > max_size)
+    {
+        FSFILE_SetSize(handle, 0);
+        offset = 0;
     }
-    FSUSER_CreateFile(archive, path, 0, size);
-    char *buf = calloc(size, 1);
-    buf_to_file(size, path, archive, buf);
-    free(buf);
+
+    u32 written;
+    res = FSFILE_Write(handle, &written, offset, buf, size, FS_WRITE_FLUSH);
+    FSFILE_Close(handle);
+    return res;
 }
@@ -0,0 +1,251 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#include "hash.h"
+
+// Rotations compile to a single ror, or are folded into the barrel shifter of the next
+// instruction on the ARM11. It has no NEON or SHA instructions, so this is all plain C.
+static inline u32 rotr(u32 x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static inline u32 rotl(u32 x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static inline u32 read_be32(const u8 * p)
+{
+    return (u32)p[0] << 24 | (u32)p[1] << 16 | (u32)p[2] << 8 | (u32)p[3];
+}
+
+static inline u32 read_le32(const u8 * p)
+{
+    return (u32)p[0] | (u32)p[1] << 8 | (u32)p[2] << 16 | (u32)p[3] << 24;
+}
+
+static const u32 sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// The message schedule is kept as a rolling window of 16 words instead of all 64
+static void sha256_block(u32 * state, const u8 * block)
+{
+    u32 w[16];
+    for(int i = 0; i < 16; i++)
+        w[i] = read_be32(block + i*4);
+
+    u32 a = state[0], b = state[1], c = state[2], d = state[3];
+    u32 e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for(int i = 0; i < 64; i++)
+    {
+        if(i >= 16)
+        {
+            u32 w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+            u32 s0 = rotr(w15, 7) ^ rotr(w15, 18) ^ (w15 >> 3);
+            u32 s1 = rotr(w2, 17) ^ rotr(w2, 19) ^ (w2 >> 10);
+            w[i & 15] += s0 + w[(i - 7) & 15] + s1;
+        }
+
+        u32 t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i & 15];
+        u32 t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256_init(Sha256_s * ctx)
+{
+    static const u32 initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->block_len = 0;
+}
+
+void sha256_update(Sha256_s * ctx, const void * data, size_t size)
+{
+    const u8 * bytes = (const u8 *)data;
+    ctx->length += size;
+
+    if(ctx->block_len)
+    {
+        size_t count = 64 - ctx->block_len < size ? 64 - ctx->block_len : size;
+        memcpy(ctx->block + ctx->block_len, bytes, count);
+        ctx->block_len += count;
+        bytes += count;
+        size -= count;
+        if(ctx->block_len < 64) return;
+        sha256_block(ctx->state, ctx->block);
+        ctx->block_len = 0;
+    }
+
+    // Whole blocks straight from the caller's buffer
+    for(; size >= 64; bytes += 64, size -= 64)
+        sha256_block(ctx->state, bytes);
+
+    memcpy(ctx->block, bytes, size);
+    ctx->block_len = size;
+}
+
+void sha256_final(Sha256_s * ctx, u8 * hash)
+{
+    u64 bits = ctx->length * 8;
+    ctx->block[ctx->block_len++] = 0x80;
+    if(ctx->block_len > 56)
+    {
+        memset(ctx->block + ctx->block_len, 0, 64 - ctx->block_len);
+        sha256_block(ctx->state, ctx->block);
+        ctx->block_len = 0;
+    }
+    memset(ctx->block + ctx->block_len, 0, 56 - ctx->block_len);
+    for(int i = 0; i < 8; i++)
+        ctx->block[56 + i] = bits >> (56 - i*8);
+    sha256_block(ctx->state, ctx->block);
+
+    for(int i = 0; i < 8; i++)
+    {
+        hash[i*4] = ctx->state[i] >> 24;
+        hash[i*4 + 1] = ctx->state[i] >> 16;
+        hash[i*4 + 2] = ctx->state[i] >> 8;
+        hash[i*4 + 3] = ctx->state[i];
+    }
+}
+
+void sha256(const void * data, size_t size, u8 * hash)
+{
+    Sha256_s ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, size);
+    sha256_final(&ctx, hash);
+}
+
+#define XXH_PRIME1 0x9E3779B1U
+#define XXH_PRIME2 0x85EBCA77U
+#define XXH_PRIME3 0xC2B2AE3DU
+#define XXH_PRIME4 0x27D4EB2FU
+#define XXH_PRIME5 0x165667B1U
+
+static inline u32 xxh32_round(u32 acc, u32 input)
+{
+    acc += input * XXH_PRIME2;
+    acc = rotl(acc, 13);
+    return acc * XXH_PRIME1;
+}
+
+void xxh32_init(Xxh32_s * ctx, u32 seed)
+{
+    ctx->v[0] = seed + XXH_PRIME1 + XXH_PRIME2;
+    ctx->v[1] = seed + XXH_PRIME2;
+    ctx->v[2] = seed;
+    ctx->v[3] = seed - XXH_PRIME1;
+    ctx->seed = seed;
+    ctx->total_len = 0;
+    ctx->block_len = 0;
+}
+
+void xxh32_update(Xxh32_s * ctx, const void * data, size_t size)
+{
+    const u8 * bytes = (const u8 *)data;
+    ctx->total_len += size;
+
+    if(ctx->block_len)
+    {
+        size_t count = 16 - ctx->block_len < size ? 16 - ctx->block_len : size;
+        memcpy(ctx->block + ctx->block_len, bytes, count);
+        ctx->block_len += count;
+        bytes += count;
+        size -= count;
+        if(ctx->block_len < 16) return;
+        for(int i = 0; i < 4; i++)
+            ctx->v[i] = xxh32_round(ctx->v[i], read_le32(ctx->block + i*4));
+        ctx->block_len = 0;
+    }
+
+    u32 v0 = ctx->v[0], v1 = ctx->v[1], v2 = ctx->v[2], v3 = ctx->v[3];
+    for(; size >= 16; bytes += 16, size -= 16)
+    {
+        v0 = xxh32_round(v0, read_le32(bytes));
+        v1 = xxh32_round(v1, read_le32(bytes + 4));
+        v2 = xxh32_round(v2, read_le32(bytes + 8));
+        v3 = xxh32_round(v3, read_le32(bytes + 12));
+    }
+    ctx->v[0] = v0; ctx->v[1] = v1; ctx->v[2] = v2; ctx->v[3] = v3;
+
+    memcpy(ctx->block, bytes, size);
+    ctx->block_len = size;
+}
+
+u32 xxh32_final(const Xxh32_s * ctx)
+{
+    u32 hash;
+    if(ctx->total_len >= 16)
+        hash = rotl(ctx->v[0], 1) + rotl(ctx->v[1], 7) + rotl(ctx->v[2], 12) + rotl(ctx->v[3], 18);
+    else
+        hash = ctx->seed + XXH_PRIME5;
+    hash += ctx->total_len;
+
+    const u8 * p = ctx->block;
+    u32 left = ctx->block_len;
+    for(; left >= 4; p += 4, left -= 4)
+        hash = rotl(hash + read_le32(p) * XXH_PRIME3, 17) * XXH_PRIME4;
+    for(; left; p++, left--)
+        hash = rotl(hash + *p * XXH_PRIME5, 11) * XXH_PRIME1;
+
+    hash ^= hash >> 15;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 13;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+u32 xxh32(const void * data, size_t size, u32 seed)
+{
+    Xxh32_s ctx;
+    xxh32_init(&ctx, seed);
+    xxh32_update(&ctx, data, size);
+    return xxh32_final(&ctx);
+}
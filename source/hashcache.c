@@ -0,0 +1,345 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#include "hashcache.h"
+#include "fs.h"
+#include "unicode.h"
+
+static Hash_Cache_Entry_s hash_cache[HASH_CACHE_ENTRIES];
+static u32 hash_cache_clock = 0;
+static bool hash_cache_dirty = false;
+static volatile u32 extdata_generation = 0;
+static Handle hash_cache_mutex = 0;
+
+// FNV-1a, continued from hash so a file name or offset can be added to a path
+static u32 fnv1a(u32 hash, const void * data, size_t size)
+{
+    const u8 * bytes = (const u8 *)data;
+    for(size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+u32 entry_key(const u16 * path, const char * filename)
+{
+    u32 key = fnv1a(0x811C9DC5, path, strulen(path, 0x106)*sizeof(u16));
+    return fnv1a(key, filename, strlen(filename));
+}
+
+static u32 file_key(const char * path, u32 offset)
+{
+    u32 key = fnv1a(0x811C9DC5, path, strlen(path));
+    return fnv1a(key, &offset, sizeof(offset));
+}
+
+// Found if the file hasn't changed, and its SHA-256 is known when one is asked for
+static bool hash_cache_find(u32 key, bool extdata, const Data_Info_s * info, u32 * fast_hash, u8 * sha)
+{
+    bool found = false;
+    svcWaitSynchronization(hash_cache_mutex, U64_MAX);
+    for(int i = 0; i < HASH_CACHE_ENTRIES; i++)
+    {
+        Hash_Cache_Entry_s * entry = &hash_cache[i];
+        if(entry->last_used && entry->key == key && entry->extdata == extdata && !memcmp(&entry->info, info, sizeof(Data_Info_s)))
+        {
+            if(sha != NULL && !entry->has_sha)
+                break;
+
+            *fast_hash = entry->fast_hash;
+            if(sha != NULL)
+                memcpy(sha, entry->sha, SHA256_SIZE);
+            entry->last_used = ++hash_cache_clock; // not worth a write of its own, saved along with the next change
+            found = true;
+            break;
+        }
+    }
+    svcReleaseMutex(hash_cache_mutex);
+    return found;
+}
+
+// Replaces the entry for the same file if there is one, the least recently used otherwise
+static void hash_cache_store(u32 key, bool extdata, const Data_Info_s * info, u32 fast_hash, const u8 * sha)
+{
+    svcWaitSynchronization(hash_cache_mutex, U64_MAX);
+    Hash_Cache_Entry_s * slot = &hash_cache[0];
+    for(int i = 0; i < HASH_CACHE_ENTRIES; i++)
+    {
+        Hash_Cache_Entry_s * entry = &hash_cache[i];
+        if(entry->last_used && entry->key == key && entry->extdata == extdata)
+        {
+            slot = entry;
+            break;
+        }
+        if(entry->last_used < slot->last_used)
+            slot = entry;
+    }
+
+    slot->key = key;
+    slot->extdata = extdata;
+    slot->info = *info;
+    slot->fast_hash = fast_hash;
+    slot->has_sha = sha != NULL;
+    if(sha != NULL)
+        memcpy(slot->sha, sha, SHA256_SIZE);
+    else
+        memset(slot->sha, 0, SHA256_SIZE);
+    slot->last_used = ++hash_cache_clock;
+    hash_cache_dirty = true;
+    svcReleaseMutex(hash_cache_mutex);
+}
+
+// Hashes a file worth of stream as it's read, a chunk at a time: the data itself is never kept
+static bool hash_stream(Stream_s * stream, u32 size, bool with_sha, File_Hash_s * hash)
+{
+    u64 start = svcGetSystemTick();
+    char * chunk = malloc(STREAM_HASH_CHUNK);
+    stream_hash(stream, with_sha);
+
+    u32 done = 0;
+    while(done < size)
+    {
+        u32 wanted = size - done < STREAM_HASH_CHUNK ? size - done : STREAM_HASH_CHUNK;
+        u32 read = stream_read(stream, chunk, wanted);
+        done += read;
+        if(read != wanted) break;
+    }
+    free(chunk);
+
+    bool ok = done == size && stream_hash_result(stream, hash);
+    DEBUG("<hash_stream> %lu bytes read and hashed (%s) in %llu us\n", done, with_sha ? "xxh32+sha256" : "xxh32",
+          (svcGetSystemTick() - start) / (SYSCLOCK_ARM11 / 1000000));
+    return ok;
+}
+
+static bool hash_and_store(u32 key, bool extdata, const Data_Info_s * info, Stream_s * stream, u32 size, u32 * fast_hash, u8 * sha)
+{
+    File_Hash_s hash;
+    if(!hash_stream(stream, size, sha != NULL, &hash))
+        return false;
+
+    *fast_hash = hash.fast;
+    if(sha != NULL)
+        memcpy(sha, hash.sha, SHA256_SIZE);
+    hash_cache_store(key, extdata, info, hash.fast, sha);
+    return true;
+}
+
+// For hashes worked out elsewhere. A SHA-256 already known for the same data isn't thrown away
+// for an entry that only has the fast hash.
+static void hash_cache_put(u32 key, bool extdata, const Data_Info_s * info, const File_Hash_s * hash)
+{
+    u32 fast_hash;
+    u8 sha[SHA256_SIZE];
+    if(!hash->has_sha && hash_cache_find(key, extdata, info, &fast_hash, sha) && fast_hash == hash->fast)
+        return;
+
+    hash_cache_store(key, extdata, info, hash->fast, hash->has_sha ? hash->sha : NULL);
+}
+
+static bool sd_file_info(const char * path, Data_Info_s * info)
+{
+    memset(info, 0, sizeof(Data_Info_s));
+    info->size = get_file_size(fsMakePath(PATH_ASCII, path), ArchiveSD);
+    if(!info->size)
+        return false;
+
+    u16 path_utf16[0x106] = {0};
+    struacat(path_utf16, path);
+    info->mtime = file_mtime(path_utf16);
+    return true;
+}
+
+bool hash_data(char * filename, Entry_s entry, u32 * fast_hash, u8 * sha)
+{
+    Data_Info_s info;
+    if(!get_data_info(filename, entry, &info))
+        return false;
+    return hash_data_info(filename, entry, &info, fast_hash, sha);
+}
+
+bool hash_data_info(char * filename, Entry_s entry, const Data_Info_s * info, u32 * fast_hash, u8 * sha)
+{
+    if(!info->size)
+        return false;
+
+    u32 key = entry_key(entry.path, filename);
+    if(hash_cache_find(key, false, info, fast_hash, sha))
+        return true;
+
+    Stream_s * stream = open_data_stream(filename, entry);
+    if(stream == NULL)
+        return false;
+    bool ok = hash_and_store(key, false, info, stream, info->size, fast_hash, sha);
+    stream_close(stream);
+    return ok;
+}
+
+bool hash_sd_file(const char * path, u32 * fast_hash, u8 * sha)
+{
+    Data_Info_s info;
+    if(!sd_file_info(path, &info))
+        return false;
+
+    u32 key = file_key(path, 0);
+    if(hash_cache_find(key, false, &info, fast_hash, sha))
+        return true;
+
+    Stream_s * stream = stream_open_file(fsMakePath(PATH_ASCII, path), ArchiveSD);
+    if(stream == NULL)
+        return false;
+    bool ok = hash_and_store(key, false, &info, stream, info.size, fast_hash, sha);
+    stream_close(stream);
+    return ok;
+}
+
+bool hash_extdata(const char * path, u32 offset, u32 size, u32 * fast_hash, u8 * sha)
+{
+    if(!size)
+        return false;
+
+    Data_Info_s info = {0};
+    info.size = size;
+    u32 key = file_key(path, offset);
+    if(hash_cache_find(key, true, &info, fast_hash, sha))
+        return true;
+
+    Stream_s * stream = stream_open_file(fsMakePath(PATH_ASCII, path), ArchiveThemeExt);
+    if(stream == NULL)
+        return false;
+    bool ok = stream_seek(stream, offset) && hash_and_store(key, true, &info, stream, size, fast_hash, sha);
+    stream_close(stream);
+    return ok;
+}
+
+void hash_cache_put_data(char * filename, Entry_s entry, const Data_Info_s * info, const File_Hash_s * hash)
+{
+    Data_Info_s current_info;
+    if(info == NULL)
+    {
+        if(!get_data_info(filename, entry, &current_info))
+            return;
+        info = &current_info;
+    }
+
+    hash_cache_put(entry_key(entry.path, filename), false, info, hash);
+}
+
+void hash_cache_put_sd_file(const char * path, const File_Hash_s * hash)
+{
+    Data_Info_s info;
+    if(sd_file_info(path, &info))
+        hash_cache_put(file_key(path, 0), false, &info, hash);
+}
+
+void hash_cache_put_extdata(const char * path, u32 offset, u32 size, const File_Hash_s * hash)
+{
+    Data_Info_s info = {0};
+    info.size = size;
+    hash_cache_put(file_key(path, offset), true, &info, hash);
+}
+
+void hash_cache_forget_extdata(void)
+{
+    svcWaitSynchronization(hash_cache_mutex, U64_MAX);
+    extdata_generation++;
+    for(int i = 0; i < HASH_CACHE_ENTRIES; i++)
+    {
+        if(hash_cache[i].extdata)
+            memset(&hash_cache[i], 0, sizeof(Hash_Cache_Entry_s));
+    }
+    hash_cache_dirty = true;
+    svcReleaseMutex(hash_cache_mutex);
+}
+
+u32 hash_cache_extdata_generation(void)
+{
+    return extdata_generation;
+}
+
+// mtimes only have a resolution of a couple of seconds, an install could come in under that
+void hash_cache_forget_sd_file(const char * path)
+{
+    u32 key = file_key(path, 0);
+    svcWaitSynchronization(hash_cache_mutex, U64_MAX);
+    for(int i = 0; i < HASH_CACHE_ENTRIES; i++)
+    {
+        if(!hash_cache[i].extdata && hash_cache[i].key == key)
+            memset(&hash_cache[i], 0, sizeof(Hash_Cache_Entry_s));
+    }
+    hash_cache_dirty = true;
+    svcReleaseMutex(hash_cache_mutex);
+}
+
+void init_hash_cache(void)
+{
+    svcCreateMutex(&hash_cache_mutex, false);
+
+    char * buf = NULL;
+    u32 size = file_to_buf(fsMakePath(PATH_ASCII, HASH_CACHE_PATH), ArchiveSD, &buf);
+    if(size == 2*sizeof(u32) + sizeof(hash_cache) && ((u32 *)buf)[0] == HASH_CACHE_MAGIC)
+    {
+        hash_cache_clock = ((u32 *)buf)[1];
+        memcpy(hash_cache, buf + 2*sizeof(u32), sizeof(hash_cache));
+
+        // The Home Menu may have installed another theme of the same size since the last launch
+        for(int i = 0; i < HASH_CACHE_ENTRIES; i++)
+        {
+            if(hash_cache[i].extdata)
+            {
+                memset(&hash_cache[i], 0, sizeof(Hash_Cache_Entry_s));
+                hash_cache_dirty = true;
+            }
+        }
+    }
+    free(buf);
+}
+
+void save_hash_cache(void)
+{
+    svcWaitSynchronization(hash_cache_mutex, U64_MAX);
+    if(hash_cache_dirty)
+    {
+        u32 size = 2*sizeof(u32) + sizeof(hash_cache);
+        char * buf = malloc(size);
+        ((u32 *)buf)[0] = HASH_CACHE_MAGIC;
+        ((u32 *)buf)[1] = hash_cache_clock;
+        memcpy(buf + 2*sizeof(u32), hash_cache, sizeof(hash_cache));
+
+        write_new_file(fsMakePath(PATH_ASCII, HASH_CACHE_PATH), ArchiveSD, buf, size);
+        free(buf);
+        hash_cache_dirty = false;
+    }
+    svcReleaseMutex(hash_cache_mutex);
+}
+
+void exit_hash_cache(void)
+{
+    save_hash_cache();
+    svcCloseHandle(hash_cache_mutex);
+}
@@ -0,0 +1,103 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#include "installlog.h"
+#include "queue.h"
+
+#include <time.h>
+
+static const char * phase_names[INSTALL_PHASE_AMOUNT] = {
+    "sd_read",
+    "inflate",
+    "lz_decode",
+    "lz_encode",
+    "prepare",
+    "write",
+    "flush",
+    "metadata",
+};
+
+#define TICKS_TO_MS(ticks) ((u32)((ticks) / (SYSCLOCK_ARM11 / 1000)))
+
+void install_stats_add(Install_Stats_s * stats, InstallPhase phase, u64 start_tick, u64 bytes)
+{
+    stats->ticks[phase] += svcGetSystemTick() - start_tick;
+    stats->bytes[phase] += bytes;
+}
+
+// read_ticks is all the time spent in stream_read for read_bytes. Whatever of it wasn't
+// spent on the SD card went into inflating for a zip, and into copying and hashing otherwise.
+void install_stats_add_stream(Install_Stats_s * stats, const Stream_s * stream, u64 read_ticks, u64 read_bytes)
+{
+    stats->ticks[INSTALL_PHASE_SD_READ] += stream->sd.ticks;
+    stats->bytes[INSTALL_PHASE_SD_READ] += stream->sd.bytes;
+
+    u64 rest = read_ticks > stream->sd.ticks ? read_ticks - stream->sd.ticks : 0;
+    if(stream->archive != NULL)
+    {
+        stats->ticks[INSTALL_PHASE_INFLATE] += rest;
+        stats->bytes[INSTALL_PHASE_INFLATE] += read_bytes;
+    }
+    else
+    {
+        stats->ticks[INSTALL_PHASE_SD_READ] += rest;
+    }
+}
+
+// One line per install in the log, and a shorter one shown in the top bar for a while
+void log_install_stats(const Install_Stats_s * stats, const char * kind, int count, u64 total_ticks, Result res)
+{
+    bool new_3ds = false;
+    APT_CheckNew3DS(&new_3ds);
+
+    time_t t = time(NULL);
+    struct tm tm = *localtime(&t);
+
+    char line[512];
+    int len = snprintf(line, sizeof(line), "%04i-%02i-%02i %02i:%02i:%02i %s %s count=%i result=%08lx total=%lums",
+                       tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                       new_3ds ? "n3ds" : "o3ds", kind, count, res, TICKS_TO_MS(total_ticks));
+    for(int i = 0; i < INSTALL_PHASE_AMOUNT && len > 0 && len < (int)sizeof(line); i++)
+    {
+        if(!stats->ticks[i] && !stats->bytes[i]) continue;
+        len += snprintf(line + len, sizeof(line) - len, " %s=%lums/%lluB", phase_names[i], TICKS_TO_MS(stats->ticks[i]), stats->bytes[i]);
+    }
+    if(len <= 0)
+        return;
+    if(len > (int)sizeof(line) - 2)
+        len = sizeof(line) - 2;
+    line[len++] = '\n';
+    line[len] = '\0';
+
+    DEBUG("<log_install_stats> %s", line);
+    append_to_file(fsMakePath(PATH_ASCII, INSTALL_LOG_PATH), ArchiveSD, line, len, INSTALL_LOG_MAX_SIZE);
+
+    char summary[96];
+    snprintf(summary, sizeof(summary), "%s in %lums: read %lu, inflate %lu, write %lu",
+             R_SUCCEEDED(res) ? "Done" : "Failed", TICKS_TO_MS(total_ticks), TICKS_TO_MS(stats->ticks[INSTALL_PHASE_SD_READ]), TICKS_TO_MS(stats->ticks[INSTALL_PHASE_INFLATE]),
+             TICKS_TO_MS(stats->ticks[INSTALL_PHASE_WRITE] + stats->ticks[INSTALL_PHASE_FLUSH]));
+    operation_summary(summary);
+}
@@ -0,0 +1,341 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#include "intros.h"
+
+typedef struct {
+    u16 path[0x106];
+    u32 rate;
+    ogg_int64_t loop_start;
+    ogg_int64_t loop_end;
+    s16 * pcm; // stereo
+    u32 samples;
+    u32 last_used;
+} Intro_s;
+
+static Intro_s intros[INTRO_CACHE_ENTRIES];
+static u32 intro_clock = 0;
+static Handle intro_mutex;
+
+static Thread intro_thread;
+static Handle intro_event;
+static volatile bool intro_run = false;
+static volatile u32 intro_generation = 0;
+static Entry_s intro_entries[3];
+static int intro_count = 0;
+
+static audio_s * volatile open_request = NULL; // waiting for the worker to open its decoder
+static audio_s * volatile opening = NULL; // having its decoder opened by the worker
+
+// The cache functions below expect intro_mutex to be held
+static Intro_s * cache_find(const u16 * path)
+{
+    for(int i = 0; i < INTRO_CACHE_ENTRIES; i++)
+    {
+        if(intros[i].pcm != NULL && !memcmp(intros[i].path, path, 0x106*sizeof(u16)))
+            return &intros[i];
+    }
+    return NULL;
+}
+
+static void cache_evict(Intro_s * intro)
+{
+    free(intro->pcm);
+    memset(intro, 0, sizeof(Intro_s));
+}
+
+static Intro_s * cache_oldest(void)
+{
+    Intro_s * oldest = NULL;
+    for(int i = 0; i < INTRO_CACHE_ENTRIES; i++)
+    {
+        if(intros[i].pcm != NULL && (oldest == NULL || intros[i].last_used < oldest->last_used))
+            oldest = &intros[i];
+    }
+    return oldest;
+}
+
+static u32 cache_size(void)
+{
+    u32 size = 0;
+    for(int i = 0; i < INTRO_CACHE_ENTRIES; i++)
+    {
+        if(intros[i].pcm != NULL)
+            size += intros[i].samples * 2 * sizeof(s16);
+    }
+    return size;
+}
+
+void intro_store(const u16 * path, u32 rate, ogg_int64_t loop_start, ogg_int64_t loop_end, s16 * pcm, u32 samples)
+{
+    u32 size = samples * 2 * sizeof(s16);
+    if(!samples || size > INTRO_CACHE_BUDGET)
+    {
+        free(pcm);
+        return;
+    }
+
+    svcWaitSynchronization(intro_mutex, U64_MAX);
+
+    Intro_s * intro = cache_find(path);
+    if(intro != NULL)
+        cache_evict(intro);
+
+    while(cache_size() + size > INTRO_CACHE_BUDGET)
+        cache_evict(cache_oldest());
+
+    for(int i = 0; i < INTRO_CACHE_ENTRIES && intro == NULL; i++)
+    {
+        if(intros[i].pcm == NULL)
+            intro = &intros[i];
+    }
+    if(intro == NULL)
+    {
+        intro = cache_oldest();
+        cache_evict(intro);
+    }
+
+    memcpy(intro->path, path, 0x106*sizeof(u16));
+    intro->rate = rate;
+    intro->loop_start = loop_start;
+    intro->loop_end = loop_end;
+    intro->pcm = pcm;
+    intro->samples = samples;
+    intro->last_used = ++intro_clock;
+
+    svcReleaseMutex(intro_mutex);
+}
+
+bool intro_find(audio_s * audio)
+{
+    svcWaitSynchronization(intro_mutex, U64_MAX);
+
+    Intro_s * intro = cache_find(audio->path);
+    if(intro != NULL)
+    {
+        intro->last_used = ++intro_clock;
+        audio->rate = intro->rate;
+        audio->loop_start = intro->loop_start;
+        audio->loop_end = intro->loop_end;
+        audio->intro = malloc(intro->samples * 2 * sizeof(s16));
+        memcpy(audio->intro, intro->pcm, intro->samples * 2 * sizeof(s16));
+        audio->intro_size = audio->intro_len = intro->samples;
+        audio->intro_pos = 0;
+        audio->intro_cached = true;
+    }
+
+    svcReleaseMutex(intro_mutex);
+
+    return intro != NULL;
+}
+
+static bool intro_cached(const u16 * path)
+{
+    svcWaitSynchronization(intro_mutex, U64_MAX);
+    bool cached = cache_find(path) != NULL;
+    svcReleaseMutex(intro_mutex);
+    return cached;
+}
+
+// An open request goes ahead of the prefetching, which is picked up again after it
+static bool keep_prefetching(u32 generation)
+{
+    return intro_run && generation == intro_generation && open_request == NULL;
+}
+
+static void decode_intro(const Entry_s * entry, u32 generation)
+{
+    audio_s * audio = calloc(1, sizeof(audio_s));
+    memcpy(audio->path, entry->path, 0x106*sizeof(u16));
+    audio->is_zip = entry->is_zip;
+    audio->intro_only = true;
+
+    if(!open_audio_decoder(audio))
+    {
+        free(audio);
+        return;
+    }
+
+    u64 start = svcGetSystemTick();
+    u32 size = audio->rate * INTRO_MS / 1000;
+    if(audio->loop_end && audio->loop_end < (ogg_int64_t)size)
+        size = audio->loop_end;
+
+    s16 * pcm = malloc(size * 2 * sizeof(s16));
+    u32 samples = 0;
+    while(samples < size && keep_prefetching(generation))
+    {
+        long read = decode_audio(audio, (char *)(pcm + samples * 2), (size - samples) * 2 * sizeof(s16));
+        if(read <= 0)
+            break;
+        samples += read / (2 * sizeof(s16));
+    }
+
+    // A track shorter than the intro is kept whole, its end is where it loops
+    bool complete = samples == size || (audio->loop_end == 0 && keep_prefetching(generation));
+    if(complete)
+    {
+        if(samples < size)
+            audio->loop_end = samples;
+        DEBUG("<decode_intro> %lu samples in %llu ms\n", samples, (svcGetSystemTick() - start) / (SYSCLOCK_ARM11 / 1000));
+        intro_store(audio->path, audio->rate, audio->loop_start, audio->loop_end, pcm, samples);
+    }
+    else
+    {
+        free(pcm);
+    }
+
+    close_audio_decoder(audio);
+    free(audio);
+}
+
+static void open_requested_decoder(void)
+{
+    svcWaitSynchronization(intro_mutex, U64_MAX);
+    audio_s * audio = open_request;
+    open_request = NULL;
+    opening = audio;
+    svcReleaseMutex(intro_mutex);
+
+    if(audio == NULL)
+        return;
+    open_audio_behind_intro(audio);
+
+    svcWaitSynchronization(intro_mutex, U64_MAX);
+    opening = NULL;
+    svcReleaseMutex(intro_mutex);
+}
+
+static void intro_thread_func(void * arg)
+{
+    (void)arg;
+    while(intro_run)
+    {
+        svcWaitSynchronization(intro_event, U64_MAX);
+        open_requested_decoder();
+
+        Entry_s entries[3];
+        svcWaitSynchronization(intro_mutex, U64_MAX);
+        u32 generation = intro_generation;
+        int count = intro_count;
+        memcpy(entries, intro_entries, sizeof(entries));
+        svcReleaseMutex(intro_mutex);
+
+        for(int i = 0; i < count && keep_prefetching(generation); i++)
+        {
+            if(!intro_cached(entries[i].path))
+                decode_intro(&entries[i], generation);
+        }
+
+        // Cut short by an open request, come back to it once that's done
+        if(open_request != NULL)
+            svcSignalEvent(intro_event);
+    }
+}
+
+void init_intros(void)
+{
+    svcCreateMutex(&intro_mutex, false);
+    svcCreateEvent(&intro_event, RESET_ONESHOT);
+    intro_run = true;
+    intro_thread = threadCreate(intro_thread_func, NULL, 0x10000, 0x3f, -2, false);
+    if(intro_thread == NULL)
+        intro_run = false;
+}
+
+void exit_intros(void)
+{
+    if(intro_run)
+    {
+        intro_run = false;
+        svcSignalEvent(intro_event);
+        threadJoin(intro_thread, U64_MAX);
+        threadFree(intro_thread);
+    }
+    intro_cache_clear();
+    svcCloseHandle(intro_event);
+    svcCloseHandle(intro_mutex);
+}
+
+void intro_prefetch(Entry_List_s * list)
+{
+    if(!intro_run || list == NULL || list->entries == NULL || list->entries_count < 1)
+        return;
+
+    int below = (list->selected_entry + 1) % list->entries_count;
+    int above = (list->selected_entry - 1 + list->entries_count) % list->entries_count;
+
+    svcWaitSynchronization(intro_mutex, U64_MAX);
+    intro_count = 0;
+    intro_entries[intro_count++] = list->entries[list->selected_entry];
+    if(below != list->selected_entry)
+        intro_entries[intro_count++] = list->entries[below];
+    if(above != below && above != list->selected_entry)
+        intro_entries[intro_count++] = list->entries[above];
+    intro_generation++;
+    svcReleaseMutex(intro_mutex);
+
+    svcSignalEvent(intro_event);
+}
+
+bool intro_open_decoder(audio_s * audio)
+{
+    if(!intro_run)
+        return false;
+
+    svcWaitSynchronization(intro_mutex, U64_MAX);
+    bool queued = open_request == NULL;
+    if(queued)
+        open_request = audio;
+    svcReleaseMutex(intro_mutex);
+
+    if(queued)
+        svcSignalEvent(intro_event);
+    return queued;
+}
+
+void intro_cancel_open(audio_s * audio)
+{
+    svcWaitSynchronization(intro_mutex, U64_MAX);
+    if(open_request == audio)
+        open_request = NULL;
+    svcReleaseMutex(intro_mutex);
+
+    // Seeking gives up early once the audio is stopped
+    while(opening == audio)
+        svcSleepThread(1e6);
+}
+
+void intro_cache_clear(void)
+{
+    svcWaitSynchronization(intro_mutex, U64_MAX);
+    for(int i = 0; i < INTRO_CACHE_ENTRIES; i++)
+    {
+        if(intros[i].pcm != NULL)
+            cache_evict(&intros[i]);
+    }
+    svcReleaseMutex(intro_mutex);
+}
@@ -29,8 +29,8 @@
 #include "unicode.h"
 #include "music.h"
 #include "draw.h"
-
-#include <png.h>
+#include "etc1.h"
+#include "intros.h"
 
 void delete_entry(Entry_s * entry, bool is_file)
 {
@@ -56,6 +56,73 @@ u32 load_data(char * filename, Entry_s entry, char ** buf)
     }
 }
 
+// Same as load_data, with the data hashed as it's read or inflated
+u32 load_data_hashed(char * filename, Entry_s entry, char ** buf, File_Hash_s * hash, bool with_sha)
+{
+    if(entry.is_zip)
+    {
+        return zip_file_to_buf_hashed(filename+1, entry.path, buf, hash, with_sha);
+    }
+    else
+    {
+        u16 path[0x106] = {0};
+        strucat(path, entry.path);
+        struacat(path, filename);
+
+        return file_to_buf_hashed(fsMakePath(PATH_UTF16, path), ArchiveSD, buf, hash, with_sha);
+    }
+}
+
+Stream_s * open_data_stream(char * filename, Entry_s entry)
+{
+    if(entry.is_zip)
+    {
+        return stream_open_zip(filename+1, entry.path);
+    }
+    else
+    {
+        u16 path[0x106] = {0};
+        strucat(path, entry.path);
+        struacat(path, filename);
+
+        return stream_open_file(fsMakePath(PATH_UTF16, path), ArchiveSD);
+    }
+}
+
+// Zips are looked up in the central directory, nothing is inflated
+bool get_data_info(char * filename, Entry_s entry, Data_Info_s * info)
+{
+    memset(info, 0, sizeof(Data_Info_s));
+    if(entry.is_zip)
+    {
+        Zip_Entry_s zip_entry;
+        if(!zip_file_find_entry(filename+1, entry.path, &zip_entry))
+            return false;
+
+        info->size = zip_entry.uncompressed_size;
+        info->crc32 = zip_entry.crc32;
+        info->mtime = zip_entry.mtime;
+    }
+    else
+    {
+        u16 path[0x106] = {0};
+        strucat(path, entry.path);
+        struacat(path, filename);
+
+        Handle handle;
+        if(R_FAILED(FSUSER_OpenFile(&handle, ArchiveSD, fsMakePath(PATH_UTF16, path), FS_OPEN_READ, 0)))
+            return false;
+        u64 size;
+        FSFILE_GetSize(handle, &size);
+        FSFILE_Close(handle);
+
+        info->size = size;
+        info->mtime = file_mtime(path);
+    }
+
+    return true;
+}
+
 // Function taken and adapted from https://github.com/BernardoGiordano/Checkpoint/blob/master/3ds/source/title.cpp
 C2D_Image * loadTextureIcon(Icon_s *icon)
 {
@@ -67,16 +134,18 @@ C2D_Image * loadTextureIcon(Icon_s *icon)
     static const Tex3DS_SubTexture subt3x = { 48, 48, 0.0f, 48/64.0f, 48/64.0f, 0.0f };
     image->tex = tex;
     image->subtex = &subt3x;
-    C3D_TexInit(image->tex, 64, 64, GPU_RGB565);
+    C3D_TexInit(image->tex, 64, 64, GPU_ETC1);
 
-    u16* dest = (u16*)image->tex->data + (64-48)*64;
+    // The SMDH icon is already tiled RGB565, so each row of tiles is compressed as is
+    u8* dest = (u8*)image->tex->data + etc1_size(64, 64-48);
     u16* src = icon->big_icon;
     for (int j = 0; j < 48; j += 8)
     {
-        memcpy(dest, src, 48*8*sizeof(u16));
+        etc1_encode(dest, src, GPU_RGB565, 48*8/16);
         src += 48*8;
-        dest += 64*8;
+        dest += etc1_size(64, 8);
     }
+    C3D_TexFlush(image->tex);
 
     return image;
 }
@@ -460,162 +529,24 @@ void load_icons_thread(void * void_arg)
     while(arg->run_thread);
 }
 
-bool load_preview_from_buffer(void * buf, u32 size, C2D_Image * preview_image, int * preview_offset)
+// Initialize the audio struct
+// With a cached intro, this doesn't touch the SD at all: the intro starts
+// playing straight away and the decoder is opened behind it on the intro worker
+Result load_audio(Entry_s entry, audio_s *audio) 
 {
-    if(size < 8 || png_sig_cmp(buf, 0, 8))
-    {
-        throw_error("Invalid preview.png", ERROR_LEVEL_WARNING);
-        return false;
-    }
+    memcpy(audio->path, entry.path, 0x106*sizeof(u16));
+    audio->is_zip = entry.is_zip;
 
-    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-
-    png_infop info = png_create_info_struct(png);
-
-    if(setjmp(png_jmpbuf(png)))
+    if (!intro_find(audio))
     {
-        png_destroy_read_struct(&png, &info, NULL);
-        return false;
-    }
-
-    FILE * fp = fmemopen(buf, size, "rb");
-
-    png_init_io(png, fp);
-    png_read_info(png, info);
-
-    int width = png_get_image_width(png, info);
-    int height = png_get_image_height(png, info);
-
-    png_byte color_type = png_get_color_type(png, info);
-    png_byte bit_depth  = png_get_bit_depth(png, info);
-
-    // Read any color_type into 8bit depth, ABGR format.
-    // See http://www.libpng.org/pub/png/libpng-manual.txt
-
-    if(bit_depth == 16)
-        png_set_strip_16(png);
-
-    if(color_type == PNG_COLOR_TYPE_PALETTE)
-        png_set_palette_to_rgb(png);
-
-    // PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth.
-    if(color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
-        png_set_expand_gray_1_2_4_to_8(png);
-
-    if(png_get_valid(png, info, PNG_INFO_tRNS))
-        png_set_tRNS_to_alpha(png);
-
-    // These color_type don't have an alpha channel then fill it with 0xff.
-    if(color_type == PNG_COLOR_TYPE_RGB ||
-       color_type == PNG_COLOR_TYPE_GRAY ||
-       color_type == PNG_COLOR_TYPE_PALETTE)
-        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
-
-    if(color_type == PNG_COLOR_TYPE_GRAY ||
-       color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-        png_set_gray_to_rgb(png);
-
-    //output ABGR
-    png_set_bgr(png);
-    png_set_swap_alpha(png);
-
-    png_read_update_info(png, info);
-
-    png_bytep * row_pointers = malloc(sizeof(png_bytep) * height);
-    for(int y = 0; y < height; y++) {
-        row_pointers[y] = (png_byte*)malloc(png_get_rowbytes(png,info));
-    }
-
-    png_read_image(png, row_pointers);
-
-    fclose(fp);
-    png_destroy_read_struct(&png, &info, NULL);
-
-
-    free_preview(*preview_image);
-
-    C3D_Tex* tex = malloc(sizeof(C3D_Tex));
-    preview_image->tex = tex;
-
-    Tex3DS_SubTexture * subt3x = malloc(sizeof(Tex3DS_SubTexture));
-    subt3x->width = width;
-    subt3x->height = height;
-    subt3x->left = 0.0f;
-    subt3x->top = 1.0f;
-    subt3x->right = width/512.0f;
-    subt3x->bottom = 1.0-(height/512.0f);
-    preview_image->subtex = subt3x;
-
-    C3D_TexInit(preview_image->tex, 512, 512, GPU_RGBA8);
-
-    memset(preview_image->tex->data, 0, preview_image->tex->size);
-
-    for(int j = 0; j < height; j++) {
-        png_bytep row = row_pointers[j];
-        for(int i = 0; i < width; i++) {
-            png_bytep px = &(row[i * 4]);
-            u32 dst = ((((j >> 3) * (512 >> 3) + (i >> 3)) << 6) + ((i & 1) | ((j & 1) << 1) | ((i & 2) << 1) | ((j & 2) << 2) | ((i & 4) << 2) | ((j & 4) << 3))) * 4;
-
-            memcpy(preview_image->tex->data + dst, px, sizeof(u32));
+        if (!open_audio_decoder(audio))
+        {
+            free(audio);
+            return MAKERESULT(RL_FATAL, RS_NOTFOUND, RM_APPLICATION, RD_NOT_FOUND);
         }
 
-        free(row_pointers[j]);
-    }
-
-    free(row_pointers);
-
-    *preview_offset = (width-400)/2;
-
-    return true;
-}
-
-static u16 previous_path_preview[0x106] = {0};
-bool load_preview(Entry_List_s list, C2D_Image * preview_image, int * preview_offset)
-{
-    if(list.entries == NULL) return false;
-
-    Entry_s entry = list.entries[list.selected_entry];
-
-    if(!memcmp(&previous_path_preview, &entry.path, 0x106*sizeof(u16))) return true;
-
-    char *preview_buffer = NULL;
-    u64 size = load_data("/preview.png", entry, &preview_buffer);
-
-    if(!size)
-    {
-        free(preview_buffer);
-        throw_error("No preview found.", ERROR_LEVEL_WARNING);
-        return false;
-    }
-
-    bool ret = load_preview_from_buffer(preview_buffer, size, preview_image, preview_offset);
-    free(preview_buffer);
-
-    if(ret)
-    {
-        // mark the new preview as loaded for optimisation
-        memcpy(&previous_path_preview, &entry.path, 0x106*sizeof(u16));
-    }
-
-    return ret;
-}
-
-void free_preview(C2D_Image preview)
-{
-    if(preview.tex)
-        C3D_TexDelete(preview.tex);
-    free(preview.tex);
-    free((Tex3DS_SubTexture*)preview.subtex);
-}
-
-// Initialize the audio struct
-Result load_audio(Entry_s entry, audio_s *audio) 
-{
-    audio->filesize = load_data("/bgm.ogg", entry, &audio->filebuf);
-    if (audio->filesize == 0) {
-        free(audio);
-        DEBUG("<load_audio> File not found!\n");
-        return MAKERESULT(RL_FATAL, RS_NOTFOUND, RM_APPLICATION, RD_NOT_FOUND);
+        audio->intro_size = audio->rate * INTRO_MS / 1000;
+        audio->intro = malloc(audio->intro_size * 4);
     }
 
     audio->mix[0] = audio->mix[1] = 1.0f; // Determines volume for the 12 (?) different outputs. See http://smealum.github.io/ctrulib/channel_8h.html#a30eb26f1972cc3ec28370263796c0444
@@ -624,43 +555,17 @@ Result load_audio(Entry_s entry, audio_s *audio)
     ndspChnSetInterp(0, NDSP_INTERP_LINEAR); 
     ndspChnSetMix(0, audio->mix); // See mix comment above
 
-    FILE *file = fmemopen(audio->filebuf, audio->filesize, "rb");
-    DEBUG("<load_audio> Filesize: %ld\n", audio->filesize);
-    if(file != NULL) 
-    {
-        int e = ov_open(file, &audio->vf, NULL, 0);
-        if (e < 0) 
-        {
-            DEBUG("<load_audio> Vorbis: %d\n", e);
-            free(audio->filebuf);
-            free(audio);
-            fclose(file);
-            return MAKERESULT(RL_FATAL, RS_INVALIDARG, RM_APPLICATION, RD_NO_DATA);
-        }
-
-        vorbis_info *vi = ov_info(&audio->vf, -1);
-        ndspChnSetRate(0, vi->rate);// Set sample rate to what's read from the ogg file
-        if (vi->channels == 2) {
-            DEBUG("<load_audio> Using stereo\n");
-            ndspChnSetFormat(0, NDSP_FORMAT_STEREO_PCM16); // 2 channels == Stereo
-        } else {
-            DEBUG("<load_audio> Invalid number of channels\n");
-            free(audio->filebuf);
-            free(audio);
-            fclose(file);
-            return MAKERESULT(RL_FATAL, RS_INVALIDARG, RM_APPLICATION, RD_NO_DATA);
-        }
+    ndspChnSetRate(0, audio->rate);// Set sample rate to what's read from the file
+    DEBUG("<load_audio> Using stereo\n");
+    ndspChnSetFormat(0, NDSP_FORMAT_STEREO_PCM16); // 2 channels == Stereo
 
-        audio->wave_buf[0].nsamples = audio->wave_buf[1].nsamples = vi->rate / 4; // 4 bytes per sample, samples = rate (bytes) / 4
-        audio->wave_buf[0].status = audio->wave_buf[1].status = NDSP_WBUF_DONE; // Used in play to stop from writing to current buffer
-        audio->wave_buf[0].data_vaddr = linearAlloc(BUF_TO_READ); // Most vorbis packets should only be 4 KB at most (?) Possibly dangerous assumption
-        audio->wave_buf[1].data_vaddr = linearAlloc(BUF_TO_READ);
-        DEBUG("<load_audio> Success!\n");
-        return MAKERESULT(RL_SUCCESS, RS_SUCCESS, RM_APPLICATION, RD_SUCCESS);
-    } else {
-        free(audio->filebuf);
-        free(audio);
-        DEBUG("<load_audio> fmemopen failed!\n");
-        return MAKERESULT(RL_FATAL, RS_NOTFOUND, RM_APPLICATION, RD_NOT_FOUND);
+    for (int i = 0; i < AUDIO_BUFFERS; i++)
+    {
+        audio->wave_buf[i].nsamples = audio->rate * AUDIO_BUFFER_MS / 1000;
+        audio->wave_buf[i].status = NDSP_WBUF_DONE; // Used in play to stop from writing to current buffer
+        audio->wave_buf[i].data_vaddr = linearAlloc(audio->wave_buf[i].nsamples * 4); // 4 bytes per stereo sample
     }
+    init_audio_loop(audio);
+    DEBUG("<load_audio> Success!\n");
+    return MAKERESULT(RL_SUCCESS, RS_SUCCESS, RM_APPLICATION, RD_SUCCESS);
 }
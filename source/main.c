@@ -26,6 +26,9 @@
 
 #include "fs.h"
 #include "loading.h"
+#include "previews.h"
+#include "intros.h"
+#include "hashcache.h"
 #include "themes.h"
 #include "splashes.h"
 #include "draw.h"
@@ -33,6 +36,7 @@
 #include "music.h"
 #include "remote.h"
 #include "instructions.h"
+#include "queue.h"
 #include <time.h>
 
 bool quit = false;
@@ -51,6 +55,13 @@ static Thread_Arg_s installCheckThreads_arg[MODE_AMOUNT] = {0};
 
 static Entry_List_s lists[MODE_AMOUNT] = {0};
 
+static Entry_List_s * prefetch_list = NULL;
+static int prefetch_selected = -1;
+
+static bool reload_lists = false;
+static EntryMode current_mode = MODE_THEMES;
+static EntryMode downloaded_mode = MODE_AMOUNT; // what to show once the lists reload, MODE_AMOUNT for no change
+
 int __stacksize__ = 64 * 1024;
 Result archive_result;
 u32 old_time_limit;
@@ -152,6 +163,90 @@ void free_lists(void)
     exit_thread();
 }
 
+// By path, the list may have been reloaded since the operation was queued
+static void mark_installed(Entry_List_s * list, const Entry_s * installed, int installed_count)
+{
+    for(int i = 0; i < list->entries_count; i++)
+    {
+        Entry_s * entry = &list->entries[i];
+        entry->installed = false;
+        for(int j = 0; j < installed_count && !entry->installed; j++)
+            entry->installed = !memcmp(entry->path, installed[j].path, sizeof(entry->path));
+    }
+}
+
+// A shuffle that didn't install gets its selection back, merged with anything picked since
+static void restore_shuffle(Entry_List_s * list, const Entry_s * selected, int selected_count)
+{
+    for(int i = 0; i < list->entries_count && list->shuffle_count < MAX_SHUFFLE_THEMES; i++)
+    {
+        Entry_s * entry = &list->entries[i];
+        if(entry->in_shuffle) continue;
+        for(int j = 0; j < selected_count; j++)
+        {
+            if(!memcmp(entry->path, selected[j].path, sizeof(entry->path)))
+            {
+                entry->in_shuffle = true;
+                entry->no_bgm_shuffle = selected[j].no_bgm_shuffle;
+                list->shuffle_count++;
+                break;
+            }
+        }
+    }
+}
+
+// What the worker is done with is applied to the lists here, on the main thread.
+// Errors are only shown when there's a UI left to show them on.
+static void handle_finished_operations(bool show_errors)
+{
+    Operation_s operation;
+    while(next_finished_operation(&operation))
+    {
+        if(operation.error != NULL && show_errors)
+            throw_error(operation.error, operation.error_level);
+
+        if(R_FAILED(operation.result))
+        {
+            DEBUG("%s failed: %lx\n", operation_names[operation.type], operation.result);
+            if(operation.type == OPERATION_INSTALL_SHUFFLE)
+                restore_shuffle(&lists[MODE_THEMES], operation.shuffle_entries, operation.shuffle_count);
+        }
+        else
+        {
+            switch(operation.type)
+            {
+                case OPERATION_INSTALL_THEME:
+                case OPERATION_INSTALL_NO_BGM:
+                case OPERATION_INSTALL_BGM:
+                    mark_installed(&lists[MODE_THEMES], &operation.entry, 1);
+                    installed_themes = true;
+                    break;
+                case OPERATION_INSTALL_SHUFFLE:
+                    mark_installed(&lists[MODE_THEMES], operation.shuffle_entries, operation.shuffle_count);
+                    installed_themes = true;
+                    break;
+                case OPERATION_INSTALL_SPLASH:
+                    mark_installed(&lists[MODE_SPLASHES], &operation.entry, 1);
+                    break;
+                case OPERATION_DELETE_SPLASH:
+                    mark_installed(&lists[MODE_SPLASHES], NULL, 0);
+                    break;
+                case OPERATION_DOWNLOAD:
+                    downloaded_mode = operation.mode;
+                    reload_lists = true;
+                    break;
+                case OPERATION_DELETE_ENTRY:
+                    reload_lists = true;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        free_operation(&operation);
+    }
+}
+
 void exit_function(bool power_pressed)
 {
     if(audio)
@@ -159,8 +254,14 @@ void exit_function(bool power_pressed)
         audio->stop = true;
         svcWaitSynchronization(audio->finished, U64_MAX);
     }
+    exit_operation_queue();
+    handle_finished_operations(false);
     free_lists();
     svcCloseHandle(update_icons_mutex);
+    if(dspfirm)
+        exit_intros();
+    exit_previews();
+    exit_hash_cache();
     exit_screens();
     exit_services();
 
@@ -189,6 +290,10 @@ static void start_thread(void)
 static void load_lists(Entry_List_s * lists)
 {
     free_lists();
+    preview_cache_clear();
+    if(dspfirm)
+        intro_cache_clear();
+    prefetch_list = NULL;
     for(int i = 0; i < MODE_AMOUNT; i++)
     {
         InstallType loading_screen = INSTALL_NONE;
@@ -324,6 +429,43 @@ static void toggle_shuffle(Entry_List_s * list)
     }
 }
 
+static void queue_entry_operation(OperationType type, EntryMode mode, Entry_s * entry)
+{
+    Operation_s operation = {
+        .type = type,
+        .mode = mode,
+        .entry = *entry,
+    };
+    if(!queue_operation(&operation))
+        throw_error("Too many operations waiting,\nlet some of them finish first.", ERROR_LEVEL_WARNING);
+}
+
+// The themes are copied, so the next shuffle can be picked while this one installs
+static void queue_shuffle_operation(Entry_List_s * list)
+{
+    Operation_s operation = {
+        .type = OPERATION_INSTALL_SHUFFLE,
+        .mode = list->mode,
+        .shuffle_entries = calloc(list->shuffle_count, sizeof(Entry_s)),
+    };
+    for(int i = 0; i < list->entries_count && operation.shuffle_count < list->shuffle_count; i++)
+    {
+        if(list->entries[i].in_shuffle)
+            operation.shuffle_entries[operation.shuffle_count++] = list->entries[i];
+    }
+
+    if(!queue_operation(&operation))
+    {
+        free_operation(&operation);
+        throw_error("Too many operations waiting,\nlet some of them finish first.", ERROR_LEVEL_WARNING);
+        return;
+    }
+
+    for(int i = 0; i < list->entries_count; i++)
+        list->entries[i].in_shuffle = list->entries[i].no_bgm_shuffle = false;
+    list->shuffle_count = 0;
+}
+
 static inline void wait_scroll(void)
 {
     released = true;
@@ -336,6 +478,11 @@ int main(void)
     srand(time(NULL));
     init_services();
     init_screens();
+    init_previews();
+    init_hash_cache();
+    init_operation_queue();
+    if(dspfirm)
+        init_intros();
 
     svcCreateMutex(&update_icons_mutex, true);
 
@@ -354,8 +501,6 @@ int main(void)
     load_lists(lists);
     #endif
 
-    EntryMode current_mode = MODE_THEMES;
-
     bool preview_mode = false;
     int preview_offset = 0;
 
@@ -382,6 +527,19 @@ int main(void)
         }
         #endif
 
+        handle_finished_operations(true);
+        // Not from under a preview or a menu that's using the current list
+        if(reload_lists && !preview_mode && !qr_mode && !install_mode && !extra_mode)
+        {
+            reload_lists = false;
+            load_lists(lists);
+            if(downloaded_mode != MODE_AMOUNT)
+            {
+                current_mode = downloaded_mode;
+                downloaded_mode = MODE_AMOUNT;
+            }
+        }
+
         hidScanInput();
         u32 kDown = hidKeysDown();
         u32 kHeld = hidKeysHeld();
@@ -389,6 +547,15 @@ int main(void)
 
         current_list = &lists[current_mode];
 
+        if(current_list->entries != NULL && (current_list != prefetch_list || current_list->selected_entry != prefetch_selected))
+        {
+            prefetch_list = current_list;
+            prefetch_selected = current_list->selected_entry;
+            preview_prefetch(current_list);
+            if(current_mode == MODE_THEMES)
+                intro_prefetch(current_list);
+        }
+
         Instructions_s instructions = normal_instructions[current_mode];
         if(install_mode)
             instructions = install_instructions;
@@ -410,7 +577,21 @@ int main(void)
         if(qr_mode) take_picture();
         else if(preview_mode)
         {
+            if(!update_preview(&preview, &preview_offset))
+            {
+                preview_mode = false;
+                if(current_mode == MODE_THEMES && audio)
+                {
+                    audio->stop = true;
+                    svcWaitSynchronization(audio->finished, U64_MAX);
+                    audio = NULL;
+                }
+            }
             draw_preview(preview, preview_offset);
+            #ifdef DEBUG_OVERLAY
+            if(audio != NULL)
+                draw_audio_stats(audio);
+            #endif
         }
         else {
             if(!iconLoadingThread_arg.run_thread)
@@ -503,6 +684,7 @@ int main(void)
                 else
                 {
                     preview_mode = false;
+                    cancel_preview();
                     if(current_mode == MODE_THEMES && audio)
                     {
                         audio->stop = true;
@@ -515,6 +697,7 @@ int main(void)
             else if(preview_mode && kDown & (KEY_B | KEY_TOUCH))
             {
                 preview_mode = false;
+                cancel_preview();
                 if(current_mode == MODE_THEMES && audio)
                 {
                     audio->stop = true;
@@ -539,51 +722,15 @@ int main(void)
             {
                 if((kDown | kHeld) & KEY_DLEFT)
                 {
-                    draw_install(INSTALL_BGM);
-                    if(R_SUCCEEDED(bgm_install(*current_entry)))
-                    {
-                        for(int i = 0; i < current_list->entries_count; i++)
-                        {
-                            Entry_s * theme = &current_list->entries[i];
-                            if(theme == current_entry)
-                                theme->installed = true;
-                            else
-                                theme->installed = false;
-                        }
-                        installed_themes = true;
-                    }
+                    queue_entry_operation(OPERATION_INSTALL_BGM, current_mode, current_entry);
                 }
                 else if((kDown | kHeld) & KEY_DUP)
                 {
-                    draw_install(INSTALL_SINGLE);
-                    if(R_SUCCEEDED(theme_install(*current_entry)))
-                    {
-                        for(int i = 0; i < current_list->entries_count; i++)
-                        {
-                            Entry_s * theme = &current_list->entries[i];
-                            if(theme == current_entry)
-                                theme->installed = true;
-                            else
-                                theme->installed = false;
-                        }
-                        installed_themes = true;
-                    }
+                    queue_entry_operation(OPERATION_INSTALL_THEME, current_mode, current_entry);
                 }
                 else if((kDown | kHeld) & KEY_DRIGHT)
                 {
-                    draw_install(INSTALL_NO_BGM);
-                    if(R_SUCCEEDED(no_bgm_install(*current_entry)))
-                    {
-                        for(int i = 0; i < current_list->entries_count; i++)
-                        {
-                            Entry_s * theme = &current_list->entries[i];
-                            if(theme == current_entry)
-                                theme->installed = true;
-                            else
-                                theme->installed = false;
-                        }
-                        installed_themes = true;
-                    }
+                    queue_entry_operation(OPERATION_INSTALL_NO_BGM, current_mode, current_entry);
                 }
                 else if((kDown | kHeld) & KEY_DDOWN)
                 {
@@ -597,24 +744,7 @@ int main(void)
                     }
                     else
                     {
-                        draw_install(INSTALL_SHUFFLE);
-                        Result res = shuffle_install(*current_list);
-                        if(R_FAILED(res)) DEBUG("shuffle install result: %lx\n", res);
-                        else
-                        {
-                            for(int i = 0; i < current_list->entries_count; i++)
-                            {
-                                Entry_s * theme = &current_list->entries[i];
-                                if(theme->in_shuffle)
-                                {
-                                    theme->in_shuffle = false;
-                                    theme->installed = true;
-                                }
-                                else theme->installed = false;
-                            }
-                            current_list->shuffle_count = 0;
-                            installed_themes = true;
-                        }
+                        queue_shuffle_operation(current_list);
                     }
                 }
             }
@@ -633,11 +763,7 @@ int main(void)
                     if((kDown | kHeld) & KEY_DLEFT)
                     {
                         browse_themeplaza:
-                        if(themeplaza_browser(current_mode))
-                        {
-                            current_mode = MODE_THEMES;
-                            load_lists(lists);
-                        }
+                        themeplaza_browser(current_mode);
                     }
                     else if((kDown | kHeld) & KEY_DUP)
                     {
@@ -685,16 +811,7 @@ int main(void)
                     install_mode = true;
                     break;
                 case MODE_SPLASHES:
-                    draw_install(INSTALL_SPLASH);
-                    splash_install(*current_entry);
-                    for(int i = 0; i < current_list->entries_count; i++)
-                    {
-                        Entry_s * splash = &current_list->entries[i];
-                        if(splash == current_entry)
-                            splash->installed = true;
-                        else
-                            splash->installed = false;
-                    }
+                    queue_entry_operation(OPERATION_INSTALL_SPLASH, current_mode, current_entry);
                     break;
                 default:
                     break;
@@ -710,8 +827,7 @@ int main(void)
                 case MODE_SPLASHES:
                     if(draw_confirm("Are you sure you would like to delete\nthe installed splash?", current_list))
                     {
-                        draw_install(INSTALL_SPLASH_DELETE);
-                        splash_delete();
+                        queue_entry_operation(OPERATION_DELETE_SPLASH, current_mode, current_entry);
                     }
                     break;
                 default:
@@ -726,9 +842,7 @@ int main(void)
         {
             if(draw_confirm("Are you sure you would like to delete this?", current_list))
             {
-                draw_install(INSTALL_ENTRY_DELETE);
-                delete_entry(current_entry, current_entry->is_zip);
-                load_lists(lists);
+                queue_entry_operation(OPERATION_DELETE_ENTRY, current_mode, current_entry);
             }
         }
 
@@ -24,56 +24,532 @@
 *         reasonable ways as different from the original version.
 */
 
+#include <strings.h>
+
 #include "music.h"
 #include "loading.h"
+#include "intros.h"
 
-// Play a given audio struct
-Result update_audio(audio_s *audio) 
+// Tremor reads the ogg through these, so only a few KB of it are in memory at a time
+static size_t stream_read_func(void *ptr, size_t size, size_t nmemb, void *datasource)
 {
-    u32 size = audio->wave_buf[audio->buf_pos].nsamples * 4 - audio->data_read;
-    DEBUG("<update_audio> Audio Size: %ld\n", size);
-    if (audio->wave_buf[audio->buf_pos].status == NDSP_WBUF_DONE) // only run if the current selected buffer has already finished playing
-    { 
-        DEBUG("<update_audio> Attempting ov_read\n");
-        int bitstream;
-        u32 read = ov_read(&audio->vf, (char*)audio->wave_buf[audio->buf_pos].data_vaddr + audio->data_read, size, &bitstream); // read 1 vorbis packet into wave buffer
-        DEBUG("<update_audio> ov_read successful\n");
+    return stream_read((Stream_s *)datasource, ptr, size*nmemb) / size;
+}
 
-        if (read <= 0) // EoF or error
-        { 
+static int stream_seek_func(void *datasource, ogg_int64_t offset, int whence)
+{
+    Stream_s *stream = (Stream_s *)datasource;
+    s64 base = 0;
+    if(whence == SEEK_CUR) base = stream->offset;
+    else if(whence == SEEK_END) base = stream->size;
+
+    if(base + offset < 0) return -1;
+    return stream_seek(stream, base + offset) ? 0 : -1;
+}
+
+static long stream_tell_func(void *datasource)
+{
+    return ((Stream_s *)datasource)->offset;
+}
+
+static int open_audio_stream(audio_s *audio)
+{
+    // Seeking in a zip means inflating everything before that point again, so zips are
+    // given to Tremor as unseekable. It then only reads the headers before playing.
+    ov_callbacks callbacks = {
+        .read_func = stream_read_func,
+        .seek_func = stream_seekable(audio->stream) ? stream_seek_func : NULL,
+        .close_func = NULL, // the stream is closed with the audio struct
+        .tell_func = stream_tell_func,
+    };
+    return ov_open_callbacks(audio->stream, &audio->vf, NULL, 0, callbacks);
+}
+
+// Runs on the DSP thread once per audio frame, only wakes the decoder up when it has something to do
+static void audio_frame_callback(void *data)
+{
+    audio_s *audio = (audio_s*)data;
+
+    u8 queued = 0;
+    for (int i = 0; i < AUDIO_BUFFERS; i++)
+    {
+        if (audio->wave_buf[i].status == NDSP_WBUF_QUEUED || audio->wave_buf[i].status == NDSP_WBUF_PLAYING)
+            queued++;
+    }
+    if (queued == 0 && audio->stats.queued != 0)
+        audio->stats.underruns++;
+    audio->stats.queued = queued;
+
+    if (audio->stop || audio->wave_buf[audio->buf_pos].status == NDSP_WBUF_DONE)
+        LightEvent_Signal(&audio->refill);
+}
+
+static ogg_int64_t comment_value(vorbis_comment *comment, const char *tag)
+{
+    size_t len = strlen(tag);
+    for (int i = 0; i < comment->comments; i++)
+    {
+        if (comment->comment_lengths[i] > (int)len && !strncasecmp(comment->user_comments[i], tag, len) && comment->user_comments[i][len] == '=')
+            return strtoll(comment->user_comments[i] + len + 1, NULL, 10);
+    }
+    return -1;
+}
+
+// Reads the loop points from the LOOPSTART and LOOPEND (or LOOPLENGTH) tags, if there are any.
+// A BCSTM has them in its header.
+static void read_loop_points(audio_s *audio)
+{
+    audio->loop_start = 0;
+    audio->loop_end = 0;
+
+    if (audio->bcstm)
+    {
+        if (audio->bcstm->looping)
+            audio->loop_start = audio->bcstm->loop_start;
+        audio->loop_end = audio->bcstm->sample_count;
+    }
+    else
+    {
+        vorbis_comment *comment = ov_comment(&audio->vf, -1);
+        if (comment != NULL)
+        {
+            ogg_int64_t start = comment_value(comment, "LOOPSTART");
+            ogg_int64_t end = comment_value(comment, "LOOPEND");
+            ogg_int64_t length = comment_value(comment, "LOOPLENGTH");
+            if (end < 0 && length > 0 && start >= 0)
+                end = start + length;
+
+            if (start > 0)
+                audio->loop_start = start;
+            if (end > audio->loop_start)
+                audio->loop_end = end;
+        }
+    }
+    DEBUG("<read_loop_points> Looping from %lld to %lld\n", audio->loop_start, audio->loop_end);
+}
+
+// Opens bgm.ogg, or the installed bgm.bcstm for themes that don't have one
+bool open_audio_decoder(audio_s *audio)
+{
+    Entry_s entry = {0};
+    memcpy(entry.path, audio->path, 0x106*sizeof(u16));
+    entry.is_zip = audio->is_zip;
+
+    audio->stream = open_data_stream("/bgm.ogg", entry);
+    if (audio->stream == NULL)
+    {
+        audio->stream = open_data_stream("/bgm.bcstm", entry);
+        if (audio->stream == NULL)
+        {
+            DEBUG("<open_audio_decoder> File not found!\n");
+            return false;
+        }
+
+        // Looping back seeks to the loop start block, spooled that's a memcpy rather than inflating up to it
+        if (!audio->intro_only && !stream_spool(audio->stream, AUDIO_SPOOL_MAX))
+            DEBUG("<open_audio_decoder> Too big to keep in memory, looping will inflate from the start\n");
+        audio->bcstm = bcstm_open(audio->stream);
+        if (audio->bcstm == NULL)
+        {
+            stream_close(audio->stream);
+            audio->stream = NULL;
+            return false;
+        }
+
+        audio->rate = audio->bcstm->sample_rate; // Mono is played on both channels, so it's always stereo
+    }
+    else
+    {
+        DEBUG("<open_audio_decoder> Filesize: %llu\n", audio->stream->size);
+        if (!audio->intro_only && !stream_spool(audio->stream, AUDIO_SPOOL_MAX))
+            DEBUG("<open_audio_decoder> Too big to keep in memory, looping will decode from the start\n");
+        int e = open_audio_stream(audio);
+        if (e < 0)
+        {
+            DEBUG("<open_audio_decoder> Vorbis: %d\n", e);
+            stream_close(audio->stream);
+            audio->stream = NULL;
+            return false;
+        }
+
+        vorbis_info *vi = ov_info(&audio->vf, -1);
+        if (vi->channels != 2)
+        {
+            DEBUG("<open_audio_decoder> Invalid number of channels\n");
             ov_clear(&audio->vf);
-            if (read == 0) // EoF
-            { 
-                ov_open(fmemopen(audio->filebuf, audio->filesize, "rb"), &audio->vf, NULL, 0); // Reopen file. Don't need to reinit channel stuff since it's all the same as before
-            } else // Error :(
-            { 
-                DEBUG("<update_audio> Vorbis play error: %ld\n", read);
+            stream_close(audio->stream);
+            audio->stream = NULL;
+            return false;
+        }
+        audio->rate = vi->rate;
+    }
+
+    // The cached intro came with them, and the audio thread may be using them already
+    if (!audio->intro_cached)
+        read_loop_points(audio);
+    audio->decoder_open = true;
+    return true;
+}
+
+// Opens the decoder of an audio playing its cached intro, and puts it where the intro ends.
+// Runs on the intro worker while the audio thread keeps queuing the intro.
+void open_audio_behind_intro(audio_s *audio)
+{
+    u64 start = svcGetSystemTick();
+    bool opened = open_audio_decoder(audio);
+    // A cached intro that reaches the loop end is the whole track, there is nothing to skip
+    if (opened && audio->intro_len && (!audio->loop_end || (ogg_int64_t)audio->intro_len < audio->loop_end))
+        opened = seek_audio(audio, audio->intro_len);
+    if (!opened)
+        close_audio_decoder(audio);
+    DEBUG("<open_audio_behind_intro> Decoder %s behind the intro in %llu ms\n", opened ? "opened" : "failed",
+          (svcGetSystemTick() - start) / (SYSCLOCK_ARM11 / 1000));
+
+    // Everything above has to be seen by the audio thread before it's handed over
+    __dmb();
+    audio->decoder_busy = false;
+    LightEvent_Signal(&audio->refill);
+}
+
+void close_audio_decoder(audio_s *audio)
+{
+    if (!audio->decoder_open)
+        return;
+
+    if (audio->bcstm)
+        bcstm_close(audio->bcstm);
+    else
+        ov_clear(&audio->vf);
+    stream_close(audio->stream);
+    audio->bcstm = NULL;
+    audio->stream = NULL;
+    audio->decoder_open = false;
+}
+
+void init_audio_loop(audio_s *audio)
+{
+    audio->loop_head_size = audio->wave_buf[0].nsamples;
+    audio->loop_head = malloc(audio->loop_head_size * 4);
+}
+
+// Keep the decoded samples that fall in the loop head, the first time they go by
+static void capture_loop_head(audio_s *audio, const char *data, u32 samples)
+{
+    ogg_int64_t wanted = audio->loop_start + audio->loop_head_len;
+    if (audio->loop_head_len == audio->loop_head_size || wanted < audio->position || wanted >= audio->position + (ogg_int64_t)samples)
+        return;
+
+    u32 offset = wanted - audio->position;
+    u32 count = samples - offset;
+    if (count > audio->loop_head_size - audio->loop_head_len)
+        count = audio->loop_head_size - audio->loop_head_len;
+
+    memcpy(audio->loop_head + audio->loop_head_len * 4, data + offset * 4, count * 4);
+    audio->loop_head_len += count;
+}
+
+// Seeks the decoder without touching position
+bool seek_audio(audio_s *audio, ogg_int64_t target)
+{
+    if (audio->bcstm)
+        return bcstm_seek(audio->bcstm, target);
+
+    if (ov_pcm_seek(&audio->vf, target) == 0)
+        return true;
+
+    // Zips can't seek. A spooled one can once the rest of it is inflated, Tremor is then
+    // opened again with seeking and every later wrap is a plain seek.
+    ov_clear(&audio->vf);
+    if (audio->stream->spool != NULL)
+        stream_seek(audio->stream, audio->stream->size);
+    if (!stream_seek(audio->stream, 0) || open_audio_stream(audio) < 0)
+    {
+        close_audio_decoder(audio);
+        return false;
+    }
+    if (stream_seekable(audio->stream))
+    {
+        if (ov_pcm_seek(&audio->vf, target) == 0)
+            return true;
+        close_audio_decoder(audio);
+        return false;
+    }
+
+    // Too big to spool, decode again from the start instead.
+    // With no LOOPSTART that's only the loop head, so it stays cheap.
+    // The skip buffer is kept off the audio thread's stack, which Tremor also needs.
+    ogg_int64_t position = 0;
+    char *skip = malloc(AUDIO_SKIP_SIZE);
+    if (skip == NULL)
+    {
+        close_audio_decoder(audio);
+        return false;
+    }
+    while (position < target && !audio->stop)
+    {
+        int bitstream;
+        ogg_int64_t left = (target - position) * 4;
+        long read = ov_read(&audio->vf, skip, left < AUDIO_SKIP_SIZE ? left : AUDIO_SKIP_SIZE, &bitstream);
+        if (read <= 0)
+            break;
+        position += read / 4;
+    }
+    free(skip);
+
+    if (position < target)
+    {
+        close_audio_decoder(audio);
+        return false;
+    }
+    return true;
+}
+
+// Put the decoder right after the loop head, which is replayed from memory meanwhile
+static bool wrap_audio(audio_s *audio)
+{
+    ogg_int64_t target = audio->loop_start + audio->loop_head_len;
+    audio->loop_head_replay = audio->loop_head_len;
+    audio->position = target;
+
+    return seek_audio(audio, target);
+}
+
+// Keep the start of the track for the intro cache. A track shorter than that is kept whole.
+static void capture_intro(audio_s *audio, const char *data, u32 samples, bool ended)
+{
+    if (audio->intro == NULL || audio->intro_cached)
+        return;
+
+    if (audio->position < (ogg_int64_t)audio->intro_size)
+    {
+        u32 count = audio->intro_size - audio->position < samples ? audio->intro_size - audio->position : samples;
+        memcpy(audio->intro + audio->position * 2, data, count * 4);
+        audio->intro_len = audio->position + count;
+    }
+
+    if (audio->intro_len == audio->intro_size || ended)
+    {
+        // A track shorter than the intro is kept whole, its end is where it loops
+        ogg_int64_t loop_end = audio->loop_end || !ended ? audio->loop_end : (ogg_int64_t)audio->intro_len;
+        intro_store(audio->path, audio->rate, audio->loop_start, loop_end, audio->intro, audio->intro_len);
+        audio->intro = NULL;
+    }
+}
+
+long decode_audio(audio_s *audio, char *out, u32 size)
+{
+    if (audio->bcstm)
+        return bcstm_read(audio->bcstm, (s16*)out, size / 4) * 4;
+
+    int bitstream;
+    return ov_read(&audio->vf, out, size, &bitstream); // read 1 vorbis packet into wave buffer
+}
+
+static void record_decode(Audio_Stats_s *stats, u64 ticks, long read)
+{
+    u32 bucket = ticks / (SYSCLOCK_ARM11 / 1000000) / AUDIO_LATENCY_STEP_US;
+    if (bucket >= AUDIO_LATENCY_BUCKETS)
+        bucket = AUDIO_LATENCY_BUCKETS - 1;
+
+    stats->latency[bucket]++;
+    stats->decode_calls++;
+    stats->decode_ticks += ticks;
+    if (read > 0)
+        stats->decoded_samples += read / 4;
+}
+
+// Upper bound, in us, of the bucket the given permille of decode calls falls under
+static u32 latency_percentile(const Audio_Stats_s *stats, u32 permille)
+{
+    u32 target = ((u64)stats->decode_calls * permille + 999) / 1000;
+    u32 seen = 0;
+    for (u32 i = 0; i < AUDIO_LATENCY_BUCKETS; i++)
+    {
+        seen += stats->latency[i];
+        if (seen >= target)
+            return (i + 1) * AUDIO_LATENCY_STEP_US;
+    }
+    return AUDIO_LATENCY_BUCKETS * AUDIO_LATENCY_STEP_US;
+}
+
+// One line per preview, so regressions in the decode path show up across builds and consoles
+static void log_audio_stats(const audio_s *audio, u64 busy_ticks)
+{
+    const Audio_Stats_s *stats = &audio->stats;
+    if (!stats->decode_calls)
+        return;
+
+    bool new_3ds = false;
+    APT_CheckNew3DS(&new_3ds);
+
+    u32 decode_ms = stats->decode_ticks / (SYSCLOCK_ARM11 / 1000);
+    u32 audio_ms = audio->rate ? stats->decoded_samples * 1000 / audio->rate : 0;
+    // Real time factor in hundredths: how many times faster than playback the decoder runs
+    u32 rtf = decode_ms ? audio_ms * 100 / decode_ms : 0;
+
+    // The FS calls below already take their share of the audio thread's stack
+    char *line = malloc(AUDIO_LOG_LINE_SIZE);
+    if (line == NULL)
+        return;
+    int len = snprintf(line, AUDIO_LOG_LINE_SIZE,
+        "%s %s %luHz buffers=%d calls=%lu audio=%lums decode=%lums busy=%llums rtf=%lu.%02lu "
+        "p50=%luus p90=%luus p99=%luus worst_buffer=%luus underruns=%lu min_fill=%u\n",
+        new_3ds ? "n3ds" : "o3ds", audio->bcstm ? "bcstm" : "ogg", audio->rate, AUDIO_BUFFERS,
+        stats->decode_calls, audio_ms, decode_ms, busy_ticks / (SYSCLOCK_ARM11 / 1000), rtf / 100, rtf % 100,
+        latency_percentile(stats, 500), latency_percentile(stats, 900), latency_percentile(stats, 990),
+        stats->worst_decode_us, stats->underruns, stats->min_queued);
+    if (len > 0)
+    {
+        DEBUG("<log_audio_stats> %s", line);
+        append_to_file(fsMakePath(PATH_ASCII, AUDIO_LOG_PATH), ArchiveSD, line, len < AUDIO_LOG_LINE_SIZE ? (u32)len : AUDIO_LOG_LINE_SIZE - 1, AUDIO_LOG_MAX_SIZE);
+    }
+    free(line);
+}
+
+// Decode into the current wave buffer until it's full, then queue it
+Result update_audio(audio_s *audio) 
+{
+    ndspWaveBuf *wave_buf = &audio->wave_buf[audio->buf_pos];
+    u32 size = wave_buf->nsamples * 4;
+
+    while (audio->data_read < (long)size && !audio->stop)
+    {
+        char *out = (char*)wave_buf->data_vaddr + audio->data_read;
+        u32 space = size - audio->data_read;
+
+        // A cached intro plays while the intro worker opens the decoder
+        if (audio->intro_cached && audio->intro_pos < audio->intro_len)
+        {
+            u32 count = (audio->intro_len - audio->intro_pos) * 4 < space ? (audio->intro_len - audio->intro_pos) * 4 : space;
+            memcpy(out, audio->intro + audio->intro_pos * 2, count);
+            capture_loop_head(audio, out, count / 4);
+            audio->intro_pos += count / 4;
+            audio->position += count / 4;
+            audio->data_read += count;
+            continue;
+        }
+
+        if (!audio->decoder_open || audio->decoder_busy)
+            break;
+
+        if (audio->loop_head_replay)
+        {
+            u32 replayed = audio->loop_head_len - audio->loop_head_replay;
+            u32 count = audio->loop_head_replay * 4 < space ? audio->loop_head_replay * 4 : space;
+            memcpy(out, audio->loop_head + replayed * 4, count);
+            audio->loop_head_replay -= count / 4;
+            audio->data_read += count;
+            continue;
+        }
+
+        if (audio->loop_end && audio->position + (ogg_int64_t)(space / 4) > audio->loop_end)
+            space = (audio->loop_end - audio->position) * 4;
+
+        long read = 0;
+        if (space)
+        {
+            u64 start = svcGetSystemTick();
+            read = decode_audio(audio, out, space);
+            record_decode(&audio->stats, svcGetSystemTick() - start, read);
+        }
+
+        if (read == 0) // EoF or loop end
+        {
+            capture_intro(audio, out, 0, true);
+            if (!wrap_audio(audio))
+            {
+                DEBUG("<update_audio> Couldn't loop\n");
                 ndspChnReset(0);
                 return MAKERESULT(RL_FATAL, RS_INVALIDARG, RM_APPLICATION, RD_NO_DATA);
             }
-        } else 
+        }
+        else if (read < 0) // Error :(
+        { 
+            DEBUG("<update_audio> Vorbis play error: %ld\n", read);
+            ndspChnReset(0);
+            return MAKERESULT(RL_FATAL, RS_INVALIDARG, RM_APPLICATION, RD_NO_DATA);
+        }
+        else 
         {
+            capture_loop_head(audio, out, read / 4);
+            capture_intro(audio, out, read / 4, false);
+            audio->position += read / 4;
             audio->data_read += read;
-            if (read == size) {
-                audio->data_read = 0;
-                ndspChnWaveBufAdd(0, &audio->wave_buf[audio->buf_pos]); // Add buffer to ndsp 
-                audio->buf_pos = 1 - audio->buf_pos; // switch to other buffer to load and prepare it while the current one is playing
-            }
         }
     }
+
+    if (audio->data_read == (long)size)
+    {
+        audio->data_read = 0;
+        DSP_FlushDataCache(wave_buf->data_vaddr, size);
+        ndspChnWaveBufAdd(0, wave_buf); // Add buffer to ndsp 
+        audio->buf_pos = (audio->buf_pos + 1) % AUDIO_BUFFERS; // move on to the next buffer to prepare it while the others play
+    }
+
     return MAKERESULT(RL_SUCCESS, RS_SUCCESS, RM_APPLICATION, RD_SUCCESS);
 }
 
 void thread_audio(void* data) {
     audio_s *audio = (audio_s*)data;
+
+    Audio_Stats_s *stats = &audio->stats;
+    stats->min_queued = AUDIO_BUFFERS;
+    u64 busy_ticks = 0;
+    u32 wakeups = 0;
+    bool failed = false;
+
+    // With a cached intro, the decoder is opened on the intro worker while the intro keeps being
+    // queued here. Without the worker it's opened right away, before anything plays.
+    if (!audio->decoder_open)
+    {
+        audio->decoder_busy = true;
+        if (!intro_open_decoder(audio))
+            open_audio_behind_intro(audio);
+    }
+
     while(!audio->stop) {
-        update_audio(audio);
+        // Nothing to queue once the intro has run out, until the decoder is there
+        bool starved = (!audio->decoder_open || audio->decoder_busy) && audio->intro_pos == audio->intro_len;
+        if (failed || starved || audio->wave_buf[audio->buf_pos].status != NDSP_WBUF_DONE)
+        {
+            LightEvent_Wait(&audio->refill);
+            wakeups++;
+            continue;
+        }
+
+        // Only count the fill level once the queue had a chance to fill up
+        if (stats->decoded >= AUDIO_BUFFERS && stats->queued < stats->min_queued)
+            stats->min_queued = stats->queued;
+
+        u64 start = svcGetSystemTick();
+        failed = R_FAILED(update_audio(audio));
+        u64 ticks = svcGetSystemTick() - start;
+
+        busy_ticks += ticks;
+        stats->decoded++;
+        stats->last_decode_us = ticks / (SYSCLOCK_ARM11 / 1000000);
+        if (stats->last_decode_us > stats->worst_decode_us)
+            stats->worst_decode_us = stats->last_decode_us;
     }
-    free(audio->filebuf);
-    ov_clear(&audio->vf);
-    linearFree((void*)audio->wave_buf[0].data_vaddr);
-    linearFree((void*)audio->wave_buf[1].data_vaddr);
-    while (audio->wave_buf[0].status != NDSP_WBUF_DONE || audio->wave_buf[1].status != NDSP_WBUF_DONE) svcSleepThread(1e7);
+    ndspSetCallback(NULL, NULL);
+    // Drop what's still queued instead of letting it play out, whoever stopped us is waiting
+    ndspChnWaveBufClear(0);
+    // The decoder may still be opening on the intro worker
+    intro_cancel_open(audio);
+
+    DEBUG("<thread_audio> %llu ms decoding for %lu ms of audio, %lu wakeups\n", busy_ticks / (SYSCLOCK_ARM11 / 1000), stats->decoded * AUDIO_BUFFER_MS, wakeups);
+    DEBUG("<thread_audio> %d buffers: %lu underruns, lowest fill %u, worst decode %lu us\n", AUDIO_BUFFERS, stats->underruns, stats->min_queued, stats->worst_decode_us);
+    log_audio_stats(audio, busy_ticks);
+
+    for (int i = 0; i < AUDIO_BUFFERS; i++)
+    {
+        while (audio->wave_buf[i].status == NDSP_WBUF_QUEUED || audio->wave_buf[i].status == NDSP_WBUF_PLAYING) svcSleepThread(1e7);
+    }
+    close_audio_decoder(audio);
+    free(audio->intro);
+    free(audio->loop_head);
+    for (int i = 0; i < AUDIO_BUFFERS; i++)
+        linearFree((void*)audio->wave_buf[i].data_vaddr);
     svcSignalEvent(audio->finished);
     svcSleepThread(1e8);
     svcCloseHandle(audio->finished);
@@ -81,5 +557,7 @@ void thread_audio(void* data) {
 }
 
 void play_audio(audio_s *audio) {
-    threadCreate(thread_audio, audio, 0x1000, 0x3F, 1, true);
+    LightEvent_Init(&audio->refill, RESET_ONESHOT);
+    ndspSetCallback(audio_frame_callback, audio);
+    threadCreate(thread_audio, audio, AUDIO_THREAD_STACK, 0x3F, 1, true);
 }
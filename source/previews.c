@@ -0,0 +1,902 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#include "previews.h"
+#include "loading.h"
+#include "fs.h"
+#include "unicode.h"
+#include "draw.h"
+#include "tiling.h"
+#include "etc1.h"
+
+#include <png.h>
+
+static Preview_s cache[PREVIEW_CACHE_ENTRIES];
+static u32 cache_used = 0;
+static u32 cache_clock = 0;
+static Handle cache_mutex;
+
+// Which textures are on the SD card, used to evict the least recently used ones
+typedef struct {
+    u32 key;
+    u32 size;
+    u32 last_used;
+} Texture_Cache_Index_s;
+
+static Texture_Cache_Index_s texture_index[TEXTURE_CACHE_ENTRIES];
+static u32 texture_clock = 0;
+static bool texture_index_dirty = false;
+// Apart from cache_mutex, which the UI takes every frame, as evicting and saving go to the SD card
+static Handle texture_index_mutex;
+
+static Thread preview_thread;
+static Handle preview_event;
+static volatile bool preview_run = false;
+
+static volatile u32 prefetch_generation = 0;
+static Entry_s prefetch_entries[2];
+static int prefetch_count = 0;
+
+// The preview the user asked for, decoded by the worker ahead of any prefetching
+static struct {
+    Entry_s entry;
+    bool pending;
+    volatile u32 generation;
+    PreviewState state;
+    Preview_s preview; // owned by the worker until the state is PREVIEW_READY
+    u32 rows_done;
+    u32 rows_uploaded;
+
+    u64 start_tick;
+    u64 last_frame_tick;
+    u64 worst_frame_ticks;
+    u32 frames;
+} request = {0};
+
+// Called with the number of rows decoded so far, returning false aborts decoding.
+// A preview without data takes back the buffer it was given before, ahead of it being freed.
+typedef bool (*preview_progress)(const Preview_s * preview, u32 rows, u32 generation);
+
+static bool decode_preview(void * buf, u32 size, Preview_s * preview, preview_progress progress, u32 generation)
+{
+    if(size < 8 || png_sig_cmp(buf, 0, 8))
+        return false;
+
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+
+    png_infop info = png_create_info_struct(png);
+
+    FILE * volatile fp = NULL;
+    png_bytep volatile pixels = NULL;
+    png_bytep * volatile row_pointers = NULL;
+    void * volatile data = NULL;
+
+    if(setjmp(png_jmpbuf(png)))
+    {
+        // The rows already handed out may still be copied from, until they're taken back
+        preview->data = NULL;
+        if(data != NULL && progress != NULL)
+            progress(preview, 0, generation);
+
+        png_destroy_read_struct(&png, &info, NULL);
+        if(fp != NULL)
+            fclose(fp);
+        free(row_pointers);
+        free(pixels);
+        free(data);
+        return false;
+    }
+
+    fp = fmemopen(buf, size, "rb");
+
+    png_init_io(png, fp);
+    png_read_info(png, info);
+
+    int width = png_get_image_width(png, info);
+    int height = png_get_image_height(png, info);
+
+    png_byte color_type = png_get_color_type(png, info);
+    png_byte bit_depth  = png_get_bit_depth(png, info);
+
+    // Read any color_type into 8bit depth, ABGR format.
+    // See http://www.libpng.org/pub/png/libpng-manual.txt
+
+    if(bit_depth == 16)
+        png_set_strip_16(png);
+
+    if(color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(png);
+
+    // PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth.
+    if(color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+        png_set_expand_gray_1_2_4_to_8(png);
+
+    if(png_get_valid(png, info, PNG_INFO_tRNS))
+        png_set_tRNS_to_alpha(png);
+
+    // These color_type don't have an alpha channel then fill it with 0xff.
+    if(color_type == PNG_COLOR_TYPE_RGB ||
+       color_type == PNG_COLOR_TYPE_GRAY ||
+       color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+
+    if(color_type == PNG_COLOR_TYPE_GRAY ||
+       color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+        png_set_gray_to_rgb(png);
+
+    //output ABGR
+    png_set_bgr(png);
+    png_set_swap_alpha(png);
+
+    int passes = png_set_interlace_handling(png);
+
+    png_read_update_info(png, info);
+
+    u32 stride = png_get_rowbytes(png, info);
+    int tex_width = width > PREVIEW_TEX_SIZE ? PREVIEW_TEX_SIZE : width;
+    int tex_height = height > PREVIEW_TEX_SIZE ? PREVIEW_TEX_SIZE : height;
+
+    preview->width = tex_width;
+    preview->height = tex_height;
+    preview->format = GPU_RGBA8;
+    preview->size = ((tex_height + 7) & ~7) * PREVIEW_TEX_SIZE * sizeof(u32);
+    preview->data = data = calloc(1, preview->size);
+
+    bool completed = progress == NULL || progress(preview, 0, generation);
+
+    if(completed && passes > 1)
+    {
+        // Interlaced images only have their final rows after the last pass
+        pixels = malloc(stride * height);
+        row_pointers = malloc(sizeof(png_bytep) * height);
+        for(int y = 0; y < height; y++) {
+            row_pointers[y] = pixels + y * stride;
+        }
+
+        png_read_image(png, row_pointers);
+        tile_rgba8(data, PREVIEW_TEX_SIZE, pixels, stride, tex_width, tex_height);
+        completed = progress == NULL || progress(preview, tex_height, generation);
+    }
+    else if(completed)
+    {
+        // Decode a tile row at a time, so the top screen can be shown before the rest is done
+        pixels = malloc(stride * 8);
+        for(int y = 0; y < tex_height && completed; y += 8)
+        {
+            int rows = tex_height - y < 8 ? tex_height - y : 8;
+            for(int j = 0; j < rows; j++)
+                png_read_row(png, pixels + j * stride, NULL);
+
+            tile_rgba8((u8*)data + y * PREVIEW_TEX_SIZE * sizeof(u32), PREVIEW_TEX_SIZE, pixels, stride, tex_width, rows);
+            completed = progress == NULL || progress(preview, y + rows, generation);
+        }
+    }
+
+    fclose(fp);
+    png_destroy_read_struct(&png, &info, NULL);
+
+    free(row_pointers);
+    free(pixels);
+
+    if(!completed)
+    {
+        free(data);
+        preview->data = NULL;
+    }
+
+    return completed;
+}
+
+// Bytes taken by one row of pixels of a preview texture
+static u32 preview_row_size(GPU_TEXCOLOR format)
+{
+    if(format == GPU_ETC1)
+        return etc1_size(PREVIEW_TEX_SIZE, 1);
+    return PREVIEW_TEX_SIZE * sizeof(u32);
+}
+
+static void upload_preview(const Preview_s * preview, C2D_Image * preview_image, int * preview_offset)
+{
+    free_preview(*preview_image);
+
+    C3D_Tex* tex = malloc(sizeof(C3D_Tex));
+    preview_image->tex = tex;
+
+    Tex3DS_SubTexture * subt3x = malloc(sizeof(Tex3DS_SubTexture));
+    subt3x->width = preview->width;
+    subt3x->height = preview->height;
+    subt3x->left = 0.0f;
+    subt3x->top = 1.0f;
+    subt3x->right = preview->width/(float)PREVIEW_TEX_SIZE;
+    subt3x->bottom = 1.0-(preview->height/(float)PREVIEW_TEX_SIZE);
+    preview_image->subtex = subt3x;
+
+    C3D_TexInit(preview_image->tex, PREVIEW_TEX_SIZE, PREVIEW_TEX_SIZE, preview->format);
+
+    memcpy(preview_image->tex->data, preview->data, preview->size);
+    memset((u8*)preview_image->tex->data + preview->size, 0, preview_image->tex->size - preview->size);
+    C3D_TexFlush(preview_image->tex);
+
+    *preview_offset = (preview->width-400)/2;
+}
+
+// The cache functions below expect cache_mutex to be held
+static Preview_s * cache_find(const u16 * path)
+{
+    for(int i = 0; i < PREVIEW_CACHE_ENTRIES; i++)
+    {
+        if(cache[i].data != NULL && !memcmp(cache[i].path, path, 0x106*sizeof(u16)))
+            return &cache[i];
+    }
+    return NULL;
+}
+
+static void cache_evict(Preview_s * preview)
+{
+    cache_used -= preview->size;
+    free(preview->data);
+    memset(preview, 0, sizeof(Preview_s));
+}
+
+static Preview_s * cache_oldest(void)
+{
+    Preview_s * oldest = NULL;
+    for(int i = 0; i < PREVIEW_CACHE_ENTRIES; i++)
+    {
+        if(cache[i].data != NULL && (oldest == NULL || cache[i].last_used < oldest->last_used))
+            oldest = &cache[i];
+    }
+    return oldest;
+}
+
+// Takes ownership of the preview data
+static void cache_insert(Preview_s * preview)
+{
+    if(cache_find(preview->path) != NULL || preview->size > PREVIEW_CACHE_BUDGET)
+    {
+        free(preview->data);
+        return;
+    }
+
+    while(cache_used + preview->size > PREVIEW_CACHE_BUDGET)
+        cache_evict(cache_oldest());
+
+    Preview_s * slot = NULL;
+    for(int i = 0; i < PREVIEW_CACHE_ENTRIES && slot == NULL; i++)
+    {
+        if(cache[i].data == NULL)
+            slot = &cache[i];
+    }
+    if(slot == NULL)
+    {
+        slot = cache_oldest();
+        cache_evict(slot);
+    }
+
+    *slot = *preview;
+    slot->last_used = ++cache_clock;
+    cache_used += slot->size;
+}
+
+void preview_cache_clear(void)
+{
+    svcWaitSynchronization(cache_mutex, U64_MAX);
+    for(int i = 0; i < PREVIEW_CACHE_ENTRIES; i++)
+    {
+        if(cache[i].data != NULL)
+            cache_evict(&cache[i]);
+    }
+    svcReleaseMutex(cache_mutex);
+}
+
+static u32 texture_cache_hash(const u16 * path)
+{
+    // FNV-1a
+    u32 hash = 0x811C9DC5;
+    const u8 * bytes = (const u8 *)path;
+    for(size_t i = 0; i < strulen(path, 0x106)*sizeof(u16); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+static void texture_cache_path(u32 key, char * path)
+{
+    sprintf(path, TEXTURE_CACHE_PATH "/%.8lX.bin", key);
+}
+
+static bool texture_cache_key(const Entry_s * entry, Texture_Cache_Header_s * key)
+{
+    memset(key, 0, sizeof(Texture_Cache_Header_s));
+    key->magic = TEXTURE_CACHE_MAGIC;
+    key->version = TEXTURE_CACHE_VERSION;
+    memcpy(key->path, entry->path, 0x106*sizeof(u16));
+
+    if(entry->is_zip)
+    {
+        Zip_Entry_s zip_entry;
+        if(!zip_file_find_entry("preview.png", (u16 *)entry->path, &zip_entry))
+            return false;
+
+        key->source_size = zip_entry.uncompressed_size;
+        key->source_crc32 = zip_entry.crc32;
+        key->source_mtime = zip_entry.mtime;
+    }
+    else
+    {
+        u16 path[0x106] = {0};
+        strucat(path, entry->path);
+        struacat(path, "/preview.png");
+
+        Handle handle;
+        if(R_FAILED(FSUSER_OpenFile(&handle, ArchiveSD, fsMakePath(PATH_UTF16, path), FS_OPEN_READ, 0)))
+            return false;
+        u64 size;
+        FSFILE_GetSize(handle, &size);
+        FSFILE_Close(handle);
+
+        key->source_size = size;
+        key->source_mtime = file_mtime(path);
+    }
+
+    return true;
+}
+
+// The three functions below expect texture_index_mutex to be held
+static Texture_Cache_Index_s * texture_index_find(u32 key)
+{
+    for(int i = 0; i < TEXTURE_CACHE_ENTRIES; i++)
+    {
+        if(texture_index[i].size && texture_index[i].key == key)
+            return &texture_index[i];
+    }
+    return NULL;
+}
+
+static Texture_Cache_Index_s * texture_index_oldest(u32 except)
+{
+    Texture_Cache_Index_s * oldest = NULL;
+    for(int i = 0; i < TEXTURE_CACHE_ENTRIES; i++)
+    {
+        if(texture_index[i].size && texture_index[i].key != except && (oldest == NULL || texture_index[i].last_used < oldest->last_used))
+            oldest = &texture_index[i];
+    }
+    return oldest;
+}
+
+static void texture_index_evict(Texture_Cache_Index_s * index)
+{
+    char path[0x40] = {0};
+    texture_cache_path(index->key, path);
+    FSUSER_DeleteFile(ArchiveSD, fsMakePath(PATH_ASCII, path));
+    memset(index, 0, sizeof(Texture_Cache_Index_s));
+    texture_index_dirty = true;
+}
+
+static void texture_index_touch(u32 key, u32 size)
+{
+    svcWaitSynchronization(texture_index_mutex, U64_MAX);
+    Texture_Cache_Index_s * index = texture_index_find(key);
+    if(index == NULL)
+    {
+        for(int i = 0; i < TEXTURE_CACHE_ENTRIES && index == NULL; i++)
+        {
+            if(!texture_index[i].size)
+                index = &texture_index[i];
+        }
+        if(index == NULL)
+        {
+            index = texture_index_oldest(key);
+            texture_index_evict(index);
+        }
+        index->key = key;
+    }
+
+    index->size = size;
+    index->last_used = ++texture_clock;
+    texture_index_dirty = true;
+
+    u32 total = 0;
+    for(int i = 0; i < TEXTURE_CACHE_ENTRIES; i++)
+        total += texture_index[i].size;
+
+    while(total > TEXTURE_CACHE_BUDGET)
+    {
+        Texture_Cache_Index_s * oldest = texture_index_oldest(key);
+        if(oldest == NULL) break;
+        total -= oldest->size;
+        texture_index_evict(oldest);
+    }
+    svcReleaseMutex(texture_index_mutex);
+}
+
+static void texture_index_load(void)
+{
+    char * index_buf = NULL;
+    u32 size = file_to_buf(fsMakePath(PATH_ASCII, TEXTURE_CACHE_PATH "/index.bin"), ArchiveSD, &index_buf);
+    svcWaitSynchronization(texture_index_mutex, U64_MAX);
+    if(size == 2*sizeof(u32) + sizeof(texture_index) && ((u32 *)index_buf)[0] == TEXTURE_CACHE_MAGIC)
+    {
+        texture_clock = ((u32 *)index_buf)[1];
+        memcpy(texture_index, index_buf + 2*sizeof(u32), sizeof(texture_index));
+    }
+    svcReleaseMutex(texture_index_mutex);
+    free(index_buf);
+}
+
+static void texture_index_save(void)
+{
+    svcWaitSynchronization(texture_index_mutex, U64_MAX);
+    if(texture_index_dirty)
+    {
+        u32 size = 2*sizeof(u32) + sizeof(texture_index);
+        char * index_buf = malloc(size);
+        ((u32 *)index_buf)[0] = TEXTURE_CACHE_MAGIC;
+        ((u32 *)index_buf)[1] = texture_clock;
+        memcpy(index_buf + 2*sizeof(u32), texture_index, sizeof(texture_index));
+
+        write_new_file(fsMakePath(PATH_ASCII, TEXTURE_CACHE_PATH "/index.bin"), ArchiveSD, index_buf, size);
+        free(index_buf);
+        texture_index_dirty = false;
+    }
+    svcReleaseMutex(texture_index_mutex);
+}
+
+static bool texture_cache_load(const Texture_Cache_Header_s * key, Preview_s * preview)
+{
+    u32 hash = texture_cache_hash(key->path);
+    char path[0x40] = {0};
+    texture_cache_path(hash, path);
+
+    Handle handle;
+    if(R_FAILED(FSUSER_OpenFile(&handle, ArchiveSD, fsMakePath(PATH_ASCII, path), FS_OPEN_READ, 0)))
+        return false;
+
+    Texture_Cache_Header_s header;
+    u32 read = 0;
+    FSFILE_Read(handle, &read, 0, &header, sizeof(Texture_Cache_Header_s));
+
+    bool valid = read == sizeof(Texture_Cache_Header_s) &&
+                 !memcmp(&header, key, offsetof(Texture_Cache_Header_s, width)) &&
+                 (header.format == GPU_RGBA8 || header.format == GPU_ETC1) &&
+                 header.height <= PREVIEW_TEX_SIZE &&
+                 header.data_size == preview_row_size(header.format) * ((header.height + 7) & ~7);
+
+    if(valid)
+    {
+        preview->data = malloc(header.data_size);
+        FSFILE_Read(handle, &read, sizeof(Texture_Cache_Header_s), preview->data, header.data_size);
+        valid = read == header.data_size;
+    }
+    FSFILE_Close(handle);
+
+    if(!valid)
+    {
+        free(preview->data);
+        preview->data = NULL;
+        return false;
+    }
+
+    preview->width = header.width;
+    preview->height = header.height;
+    preview->format = header.format;
+    preview->size = header.data_size;
+
+    texture_index_touch(hash, sizeof(Texture_Cache_Header_s) + header.data_size);
+
+    return true;
+}
+
+static bool preview_is_opaque(const Preview_s * preview)
+{
+    const u32 * pixels = preview->data;
+    for(int y = 0; y < preview->height; y++)
+    {
+        for(int x = 0; x < preview->width; x++)
+        {
+            if((pixels[tile_offset(x, y, PREVIEW_TEX_SIZE)] & 0xFF) != 0xFF)
+                return false;
+        }
+    }
+    return true;
+}
+
+static void texture_cache_store(Texture_Cache_Header_s * key, const Preview_s * preview)
+{
+    // Opaque previews are compressed to ETC1, which the GPU samples directly at an
+    // eighth of the size, so they also take less room in the memory cache once loaded back
+    bool opaque = preview_is_opaque(preview);
+    u32 blocks = preview->size / (16*sizeof(u32));
+
+    key->width = preview->width;
+    key->height = preview->height;
+    key->format = opaque ? GPU_ETC1 : GPU_RGBA8;
+    key->data_size = opaque ? blocks * ETC1_BLOCK_SIZE : preview->size;
+
+    u32 size = sizeof(Texture_Cache_Header_s) + key->data_size;
+    char * blob = malloc(size);
+    memcpy(blob, key, sizeof(Texture_Cache_Header_s));
+    void * data = blob + sizeof(Texture_Cache_Header_s);
+
+    if(opaque)
+    {
+        u64 start = svcGetSystemTick();
+        etc1_encode(data, preview->data, GPU_RGBA8, blocks);
+        u64 encode_ms = (svcGetSystemTick() - start) / (SYSCLOCK_ARM11 / 1000);
+        DEBUG("<texture_cache_store> ETC1: %lu blocks in %llu ms, %.2f dB, %lu -> %lu bytes\n",
+              blocks, encode_ms, etc1_psnr(data, preview->data, GPU_RGBA8, blocks), preview->size, key->data_size);
+    }
+    else
+    {
+        memcpy(data, preview->data, preview->size);
+    }
+
+    u32 hash = texture_cache_hash(key->path);
+    char path[0x40] = {0};
+    texture_cache_path(hash, path);
+    write_new_file(fsMakePath(PATH_ASCII, path), ArchiveSD, blob, size);
+    free(blob);
+
+    texture_index_touch(hash, size);
+    texture_index_save();
+}
+
+// Gets a preview from the SD card cache, or decodes it and adds it there
+static bool fetch_preview(Entry_s * entry, Preview_s * preview, preview_progress progress, u32 generation, bool * found)
+{
+    u64 start = svcGetSystemTick();
+    memcpy(preview->path, entry->path, 0x106*sizeof(u16));
+
+    Texture_Cache_Header_s key;
+    bool has_key = texture_cache_key(entry, &key);
+    if(has_key && texture_cache_load(&key, preview))
+    {
+        *found = true;
+        if(progress != NULL && !progress(preview, preview->height, generation))
+        {
+            free(preview->data);
+            preview->data = NULL;
+            return false;
+        }
+        DEBUG("<fetch_preview> warm: %llu ms\n", (svcGetSystemTick() - start) / (SYSCLOCK_ARM11 / 1000));
+        return true;
+    }
+
+    char * preview_buffer = NULL;
+    u32 size = load_data("/preview.png", *entry, &preview_buffer);
+    *found = size != 0;
+
+    bool decoded = size && decode_preview(preview_buffer, size, preview, progress, generation);
+    free(preview_buffer);
+
+    if(decoded)
+    {
+        DEBUG("<fetch_preview> cold: %llu ms\n", (svcGetSystemTick() - start) / (SYSCLOCK_ARM11 / 1000));
+        if(has_key)
+            texture_cache_store(&key, preview);
+    }
+
+    return decoded;
+}
+
+static bool prefetch_progress(const Preview_s * preview, u32 rows, u32 generation)
+{
+    (void)preview;
+    (void)rows;
+    svcWaitSynchronization(cache_mutex, U64_MAX);
+    bool pending = request.pending;
+    svcReleaseMutex(cache_mutex);
+    return preview_run && generation == prefetch_generation && !pending;
+}
+
+static bool request_progress(const Preview_s * preview, u32 rows, u32 generation)
+{
+    bool keep_going = false;
+    svcWaitSynchronization(cache_mutex, U64_MAX);
+    if(preview_run && generation == request.generation)
+    {
+        request.preview = *preview;
+        request.rows_done = rows;
+        keep_going = true;
+    }
+    svcReleaseMutex(cache_mutex);
+    return keep_going;
+}
+
+static void load_requested_preview(Entry_s * entry, u32 generation)
+{
+    Preview_s preview = {0};
+    bool found = false;
+    bool decoded = fetch_preview(entry, &preview, request_progress, generation, &found);
+
+    svcWaitSynchronization(cache_mutex, U64_MAX);
+    if(generation == request.generation)
+    {
+        if(decoded)
+            request.state = PREVIEW_READY;
+        else
+            request.state = found ? PREVIEW_INVALID : PREVIEW_NOT_FOUND;
+    }
+    else if(decoded)
+    {
+        // Cancelled right at the end, still worth keeping
+        cache_insert(&preview);
+    }
+    svcReleaseMutex(cache_mutex);
+}
+
+static void preview_thread_func(void * arg)
+{
+    (void)arg;
+    while(preview_run)
+    {
+        svcWaitSynchronization(preview_event, U64_MAX);
+
+        svcWaitSynchronization(cache_mutex, U64_MAX);
+        bool pending = request.pending;
+        Entry_s requested = request.entry;
+        u32 generation = request.generation;
+        request.pending = false;
+        svcReleaseMutex(cache_mutex);
+
+        if(pending)
+            load_requested_preview(&requested, generation);
+
+        Entry_s entries[2];
+        svcWaitSynchronization(cache_mutex, U64_MAX);
+        generation = prefetch_generation;
+        int count = prefetch_count;
+        memcpy(entries, prefetch_entries, sizeof(entries));
+        svcReleaseMutex(cache_mutex);
+
+        // Give up on older requests as soon as the selection moves again
+        for(int i = 0; i < count && prefetch_progress(NULL, 0, generation); i++)
+        {
+            svcWaitSynchronization(cache_mutex, U64_MAX);
+            bool cached = cache_find(entries[i].path) != NULL;
+            svcReleaseMutex(cache_mutex);
+            if(cached) continue;
+
+            Preview_s preview = {0};
+            bool found = false;
+            if(fetch_preview(&entries[i], &preview, prefetch_progress, generation, &found))
+            {
+                svcWaitSynchronization(cache_mutex, U64_MAX);
+                cache_insert(&preview);
+                svcReleaseMutex(cache_mutex);
+            }
+        }
+    }
+}
+
+void init_previews(void)
+{
+    svcCreateMutex(&cache_mutex, false);
+    svcCreateMutex(&texture_index_mutex, false);
+    svcCreateEvent(&preview_event, RESET_ONESHOT);
+    texture_index_load();
+    preview_run = true;
+    preview_thread = threadCreate(preview_thread_func, NULL, 0x10000, 0x3f, -2, false);
+    if(preview_thread == NULL)
+        preview_run = false;
+}
+
+void exit_previews(void)
+{
+    if(preview_run)
+    {
+        preview_run = false;
+        svcSignalEvent(preview_event);
+        threadJoin(preview_thread, U64_MAX);
+        threadFree(preview_thread);
+    }
+    cancel_preview();
+    preview_cache_clear();
+    texture_index_save();
+    svcCloseHandle(preview_event);
+    svcCloseHandle(texture_index_mutex);
+    svcCloseHandle(cache_mutex);
+}
+
+void preview_prefetch(Entry_List_s * list)
+{
+    if(!preview_run || list == NULL || list->entries == NULL || list->entries_count < 2)
+        return;
+
+    int below = (list->selected_entry + 1) % list->entries_count;
+    int above = (list->selected_entry - 1 + list->entries_count) % list->entries_count;
+
+    svcWaitSynchronization(cache_mutex, U64_MAX);
+    prefetch_count = 0;
+    prefetch_entries[prefetch_count++] = list->entries[below];
+    if(above != below)
+        prefetch_entries[prefetch_count++] = list->entries[above];
+    prefetch_generation++;
+    svcReleaseMutex(cache_mutex);
+
+    svcSignalEvent(preview_event);
+}
+
+bool load_preview_from_buffer(void * buf, u32 size, C2D_Image * preview_image, int * preview_offset)
+{
+    Preview_s preview = {0};
+    if(!decode_preview(buf, size, &preview, NULL, 0))
+    {
+        throw_error("Invalid preview.png", ERROR_LEVEL_WARNING);
+        return false;
+    }
+
+    upload_preview(&preview, preview_image, preview_offset);
+    free(preview.data);
+
+    return true;
+}
+
+static u16 previous_path_preview[0x106] = {0};
+bool load_preview(Entry_List_s list, C2D_Image * preview_image, int * preview_offset)
+{
+    if(list.entries == NULL) return false;
+
+    Entry_s entry = list.entries[list.selected_entry];
+
+    if(!memcmp(&previous_path_preview, &entry.path, 0x106*sizeof(u16))) return true;
+
+    cancel_preview();
+
+    bool cached = false;
+
+    svcWaitSynchronization(cache_mutex, U64_MAX);
+    Preview_s * preview = cache_find(entry.path);
+    if(preview != NULL)
+    {
+        preview->last_used = ++cache_clock;
+        upload_preview(preview, preview_image, preview_offset);
+        cached = true;
+    }
+    else
+    {
+        free_preview(*preview_image);
+        memset(preview_image, 0, sizeof(C2D_Image));
+
+        request.entry = entry;
+        request.pending = true;
+        request.state = PREVIEW_LOADING;
+        memset(&request.preview, 0, sizeof(Preview_s));
+        request.rows_done = 0;
+        request.rows_uploaded = 0;
+        request.start_tick = request.last_frame_tick = svcGetSystemTick();
+        request.worst_frame_ticks = 0;
+        request.frames = 0;
+    }
+    svcReleaseMutex(cache_mutex);
+
+    if(!cached)
+    {
+        if(!preview_run)
+        {
+            // No worker to hand it to, decode it right away instead
+            request.pending = false;
+            load_requested_preview(&entry, request.generation);
+        }
+        else
+            svcSignalEvent(preview_event);
+    }
+
+    // mark the new preview as loaded for optimisation
+    memcpy(&previous_path_preview, &entry.path, 0x106*sizeof(u16));
+
+    return true;
+}
+
+bool update_preview(C2D_Image * preview_image, int * preview_offset)
+{
+    svcWaitSynchronization(cache_mutex, U64_MAX);
+
+    PreviewState state = request.state;
+    if(state == PREVIEW_IDLE)
+    {
+        svcReleaseMutex(cache_mutex);
+        return true;
+    }
+
+    u64 now = svcGetSystemTick();
+    u64 frame_ticks = now - request.last_frame_tick;
+    if(frame_ticks > request.worst_frame_ticks)
+        request.worst_frame_ticks = frame_ticks;
+    request.last_frame_tick = now;
+    request.frames++;
+
+    if(request.preview.data != NULL && request.rows_done > request.rows_uploaded)
+    {
+        if(request.rows_uploaded == 0)
+        {
+            upload_preview(&request.preview, preview_image, preview_offset);
+        }
+        else
+        {
+            u32 row_size = preview_row_size(request.preview.format);
+            u32 start = request.rows_uploaded * row_size;
+            u32 end = ((request.rows_done + 7) & ~7) * row_size;
+            memcpy((u8*)preview_image->tex->data + start, (u8*)request.preview.data + start, end - start);
+            GSPGPU_FlushDataCache((u8*)preview_image->tex->data + start, end - start);
+        }
+        request.rows_uploaded = request.rows_done;
+    }
+
+    if(state != PREVIEW_LOADING)
+    {
+        DEBUG("<update_preview> %lu frames in %llu ms, worst frame %llu ms\n",
+              request.frames,
+              (now - request.start_tick) / (SYSCLOCK_ARM11 / 1000),
+              request.worst_frame_ticks / (SYSCLOCK_ARM11 / 1000));
+
+        if(state == PREVIEW_READY)
+            cache_insert(&request.preview);
+        memset(&request.preview, 0, sizeof(Preview_s));
+        request.state = PREVIEW_IDLE;
+    }
+
+    svcReleaseMutex(cache_mutex);
+
+    if(state == PREVIEW_NOT_FOUND || state == PREVIEW_INVALID)
+    {
+        memset(&previous_path_preview, 0, 0x106*sizeof(u16));
+        throw_error(state == PREVIEW_NOT_FOUND ? "No preview found." : "Invalid preview.png", ERROR_LEVEL_WARNING);
+        return false;
+    }
+
+    return true;
+}
+
+void cancel_preview(void)
+{
+    svcWaitSynchronization(cache_mutex, U64_MAX);
+    if(request.state == PREVIEW_LOADING)
+    {
+        // The worker frees whatever it was decoding once it sees the new generation
+        request.generation++;
+        request.pending = false;
+    }
+    else if(request.state == PREVIEW_READY)
+    {
+        cache_insert(&request.preview);
+    }
+    if(request.state != PREVIEW_IDLE)
+        memset(&previous_path_preview, 0, 0x106*sizeof(u16)); // the texture is incomplete
+    memset(&request.preview, 0, sizeof(Preview_s));
+    request.state = PREVIEW_IDLE;
+    svcReleaseMutex(cache_mutex);
+}
+
+void free_preview(C2D_Image preview)
+{
+    if(preview.tex)
+        C3D_TexDelete(preview.tex);
+    free(preview.tex);
+    free((Tex3DS_SubTexture*)preview.subtex);
+}
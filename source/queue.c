@@ -0,0 +1,289 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#include "queue.h"
+#include "themes.h"
+#include "splashes.h"
+#include "remote.h"
+
+const char * operation_names[OPERATION_AMOUNT] = {
+    "Installing theme",
+    "Installing theme without BGM",
+    "Installing BGM",
+    "Installing shuffle",
+    "Installing splash",
+    "Deleting splash",
+    "Deleting",
+    "Downloading",
+};
+
+static Operation_s pending[OPERATION_QUEUE_SIZE];
+static int pending_start = 0;
+static int pending_count = 0;
+
+static Operation_s finished[OPERATION_QUEUE_SIZE];
+static int finished_start = 0;
+static int finished_count = 0;
+
+static Operation_s running;
+static bool is_running = false;
+static volatile u32 running_progress = 0;
+static volatile u32 running_progress_max = 0;
+
+static char last_summary[96] = {0};
+static u64 last_summary_tick = 0;
+
+static Handle queue_mutex = 0;
+static LightSemaphore queue_ready;
+static volatile bool stopping = false;
+static Thread worker = NULL;
+
+static void run_operation(Operation_s * operation)
+{
+    switch(operation->type)
+    {
+        case OPERATION_INSTALL_THEME:
+            operation->result = theme_install(operation->entry);
+            break;
+        case OPERATION_INSTALL_NO_BGM:
+            operation->result = no_bgm_install(operation->entry);
+            break;
+        case OPERATION_INSTALL_BGM:
+            operation->result = bgm_install(operation->entry);
+            break;
+        case OPERATION_INSTALL_SHUFFLE:
+        {
+            Entry_List_s list = {0};
+            list.entries = operation->shuffle_entries;
+            list.entries_count = operation->shuffle_count;
+            list.shuffle_count = operation->shuffle_count;
+            operation->result = shuffle_install(list);
+            break;
+        }
+        case OPERATION_INSTALL_SPLASH:
+            operation->result = splash_install(operation->entry);
+            break;
+        case OPERATION_DELETE_SPLASH:
+            splash_delete();
+            break;
+        case OPERATION_DELETE_ENTRY:
+            delete_entry(&operation->entry, operation->entry.is_zip);
+            break;
+        case OPERATION_DOWNLOAD:
+            operation->result = download_remote_entry(&operation->entry, operation->mode);
+            break;
+        default:
+            break;
+    }
+}
+
+static void operation_worker(void * arg)
+{
+    (void)arg;
+
+    while(true)
+    {
+        LightSemaphore_Acquire(&queue_ready, 1);
+
+        svcWaitSynchronization(queue_mutex, U64_MAX);
+        if(stopping)
+        {
+            svcReleaseMutex(queue_mutex);
+            break;
+        }
+        running = pending[pending_start];
+        pending_start = (pending_start + 1) % OPERATION_QUEUE_SIZE;
+        pending_count--;
+        is_running = true;
+        running_progress = running_progress_max = 0;
+        svcReleaseMutex(queue_mutex);
+
+        u64 start = svcGetSystemTick();
+        run_operation(&running);
+        DEBUG("<operation_worker> %s done in %llu ms: %lx\n", operation_names[running.type],
+              (svcGetSystemTick() - start) / (SYSCLOCK_ARM11 / 1000), running.result);
+
+        svcWaitSynchronization(queue_mutex, U64_MAX);
+        finished[(finished_start + finished_count) % OPERATION_QUEUE_SIZE] = running;
+        finished_count++;
+        is_running = false;
+        svcReleaseMutex(queue_mutex);
+    }
+}
+
+void init_operation_queue(void)
+{
+    svcCreateMutex(&queue_mutex, false);
+    LightSemaphore_Init(&queue_ready, 0, OPERATION_QUEUE_SIZE + 1);
+    worker = threadCreate(operation_worker, NULL, 0x10000, 0x3f, -2, false);
+    if(worker == NULL)
+        DEBUG("couldn't start the operation worker\n");
+}
+
+// Whatever is running is let finish, the home menu's files can't be left half-written.
+// What hasn't started is dropped.
+void exit_operation_queue(void)
+{
+    if(worker != NULL)
+    {
+        svcWaitSynchronization(queue_mutex, U64_MAX);
+        stopping = true;
+        for(int i = 0; i < pending_count; i++)
+            free_operation(&pending[(pending_start + i) % OPERATION_QUEUE_SIZE]);
+        if(pending_count)
+            DEBUG("<exit_operation_queue> %i queued operations dropped\n", pending_count);
+        pending_count = 0;
+        svcReleaseMutex(queue_mutex);
+
+        LightSemaphore_Release(&queue_ready, 1);
+        threadJoin(worker, U64_MAX);
+        threadFree(worker);
+        worker = NULL;
+    }
+}
+
+// Takes over the operation's shuffle entries, unless there's no room left for it
+bool queue_operation(Operation_s * operation)
+{
+    if(worker == NULL)
+        return false;
+
+    svcWaitSynchronization(queue_mutex, U64_MAX);
+    // The finished ones count too, so there's always room to hand them back
+    bool room = pending_count + is_running + finished_count < OPERATION_QUEUE_SIZE;
+    if(room)
+    {
+        Operation_s * queued = &pending[(pending_start + pending_count) % OPERATION_QUEUE_SIZE];
+        *queued = *operation;
+        queued->result = 0;
+        queued->error = NULL;
+        pending_count++;
+    }
+    svcReleaseMutex(queue_mutex);
+
+    if(room)
+        LightSemaphore_Release(&queue_ready, 1);
+    return room;
+}
+
+// In the order they were queued. The caller frees the operation once it's been handled.
+bool next_finished_operation(Operation_s * operation)
+{
+    if(worker == NULL && !finished_count)
+        return false;
+
+    svcWaitSynchronization(queue_mutex, U64_MAX);
+    bool found = finished_count != 0;
+    if(found)
+    {
+        *operation = finished[finished_start];
+        finished_start = (finished_start + 1) % OPERATION_QUEUE_SIZE;
+        finished_count--;
+    }
+    svcReleaseMutex(queue_mutex);
+    return found;
+}
+
+void free_operation(Operation_s * operation)
+{
+    free(operation->shuffle_entries);
+    operation->shuffle_entries = NULL;
+    free(operation->error);
+    operation->error = NULL;
+}
+
+// False when nothing is running
+bool get_operation_status(Operation_Status_s * status)
+{
+    if(worker == NULL)
+        return false;
+
+    svcWaitSynchronization(queue_mutex, U64_MAX);
+    bool busy = is_running;
+    if(busy)
+    {
+        status->type = running.type;
+        status->progress = running_progress;
+        status->progress_max = running_progress_max;
+        status->queued = pending_count;
+    }
+    svcReleaseMutex(queue_mutex);
+    return busy;
+}
+
+// The summary the last operation left, for a few seconds after it was done
+bool get_operation_summary(char * summary, size_t size)
+{
+    if(worker == NULL)
+        return false;
+
+    svcWaitSynchronization(queue_mutex, U64_MAX);
+    bool recent = last_summary[0] && svcGetSystemTick() - last_summary_tick < OPERATION_SUMMARY_MS * (SYSCLOCK_ARM11 / 1000);
+    if(recent)
+        snprintf(summary, size, "%s", last_summary);
+    svcReleaseMutex(queue_mutex);
+    return recent;
+}
+
+static bool on_worker(void)
+{
+    return worker != NULL && threadGetCurrent() == worker;
+}
+
+void operation_progress(u32 current, u32 max)
+{
+    if(!on_worker())
+        return;
+
+    running_progress_max = max;
+    running_progress = current;
+}
+
+void operation_summary(const char * summary)
+{
+    if(!on_worker())
+        return;
+
+    svcWaitSynchronization(queue_mutex, U64_MAX);
+    snprintf(last_summary, sizeof(last_summary), "%s", summary);
+    last_summary_tick = svcGetSystemTick();
+    svcReleaseMutex(queue_mutex);
+}
+
+// The worker can't draw, errors wait for the main loop to pick the operation up.
+// Only the first one of an operation is kept.
+bool defer_error(const char * error, ErrorLevel level)
+{
+    if(!on_worker())
+        return false;
+
+    if(running.error == NULL)
+    {
+        running.error = strdup(error);
+        running.error_level = level;
+    }
+    return true;
+}
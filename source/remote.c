@@ -26,9 +26,11 @@
 
 #include "remote.h"
 #include "loading.h"
+#include "previews.h"
 #include "fs.h"
 #include "unicode.h"
 #include "music.h"
+#include "queue.h"
 
 static Instructions_s browser_instructions[MODE_AMOUNT] = {
     {
@@ -152,8 +154,7 @@ static C2D_Image * load_remote_smdh(Entry_s * entry, bool ignore_cache)
         u16 path[0x107] = {0};
         strucat(path, entry->path);
         struacat(path, "/info.smdh");
-        remake_file(fsMakePath(PATH_UTF16, path), ArchiveSD, smdh_size);
-        buf_to_file(smdh_size, fsMakePath(PATH_UTF16, path), ArchiveSD, smdh_buf);
+        write_new_file(fsMakePath(PATH_UTF16, path), ArchiveSD, smdh_buf, smdh_size);
     }
     free(smdh_buf);
 
@@ -282,8 +283,7 @@ static bool load_remote_preview(Entry_s * entry, C2D_Image* preview_image, int *
         u16 path[0x107] = {0};
         strucat(path, entry->path);
         struacat(path, "/preview.png");
-        remake_file(fsMakePath(PATH_UTF16, path), ArchiveSD, preview_size);
-        buf_to_file(preview_size, fsMakePath(PATH_UTF16, path), ArchiveSD, preview_png);
+        write_new_file(fsMakePath(PATH_UTF16, path), ArchiveSD, preview_png, preview_size);
     }
 
     free(preview_png);
@@ -315,8 +315,7 @@ static void load_remote_bgm(Entry_s * entry)
         u16 path[0x107] = {0};
         strucat(path, entry->path);
         struacat(path, "/bgm.ogg");
-        remake_file(fsMakePath(PATH_UTF16, path), ArchiveSD, bgm_size);
-        buf_to_file(bgm_size, fsMakePath(PATH_UTF16, path), ArchiveSD, bgm_ogg);
+        write_new_file(fsMakePath(PATH_UTF16, path), ArchiveSD, bgm_ogg, bgm_size);
 
         memcpy(&previous_path_bgm, entry->path, 0x106*sizeof(u16));
     }
@@ -324,16 +323,22 @@ static void load_remote_bgm(Entry_s * entry)
     free(bgm_ogg);
 }
 
-static void download_remote_entry(Entry_s * entry, EntryMode mode)
+// Runs on the operation worker, which reports the download's progress
+Result download_remote_entry(Entry_s * entry, EntryMode mode)
 {
     char * download_url = NULL;
     asprintf(&download_url, THEMEPLAZA_DOWNLOAD_FORMAT, entry->tp_download_id);
 
     char * zip_buf = NULL;
     char * filename = NULL;
-    draw_install(INSTALL_DOWNLOAD);
-    u32 zip_size = http_get(download_url, &filename, &zip_buf, INSTALL_DOWNLOAD);
+    u32 zip_size = http_get(download_url, &filename, &zip_buf, INSTALL_NONE);
     free(download_url);
+    if(!zip_size)
+    {
+        free(filename);
+        free(zip_buf);
+        return MAKERESULT(RL_PERMANENT, RS_CANCELED, RM_APPLICATION, RD_NO_DATA);
+    }
 
     char path_to_file[0x107] = {0};
     sprintf(path_to_file, "%s%s", main_paths[mode], filename);
@@ -344,9 +349,9 @@ static void download_remote_entry(Entry_s * entry, EntryMode mode)
         strcat(path_to_file, ".zip");
 
     DEBUG("Saving to sd: %s\n", path_to_file);
-    remake_file(fsMakePath(PATH_ASCII, path_to_file), ArchiveSD, zip_size);
-    buf_to_file(zip_size, fsMakePath(PATH_ASCII, path_to_file), ArchiveSD, zip_buf);
+    Result res = write_new_file(fsMakePath(PATH_ASCII, path_to_file), ArchiveSD, zip_buf, zip_size);
     free(zip_buf);
+    return res;
 }
 
 static SwkbdCallbackResult jump_menu_callback(void* page_number, const char** ppMessage, const char* text, size_t textlen)
@@ -453,9 +458,8 @@ static void change_selected(Entry_List_s * list, int change_value)
     list->selected_entry = newval;
 }
 
-bool themeplaza_browser(EntryMode mode)
+void themeplaza_browser(EntryMode mode)
 {
-    bool downloaded = false;
 
     bool preview_mode = false;
     int preview_offset = 0;
@@ -477,6 +481,10 @@ bool themeplaza_browser(EntryMode mode)
         if(preview_mode)
         {
             draw_preview(preview, preview_offset);
+            #ifdef DEBUG_OVERLAY
+            if(audio != NULL)
+                draw_audio_stats(audio);
+            #endif
         }
         else
         {
@@ -496,7 +504,6 @@ bool themeplaza_browser(EntryMode mode)
         {
             exit:
             quit = true;
-            downloaded = false;
             if(audio)
             {
                 audio->stop = true;
@@ -588,8 +595,14 @@ bool themeplaza_browser(EntryMode mode)
 
         if(kDown & KEY_A)
         {
-            download_remote_entry(current_entry, mode);
-            downloaded = true;
+            // The lists are reloaded once it's been saved
+            Operation_s operation = {
+                .type = OPERATION_DOWNLOAD,
+                .mode = mode,
+                .entry = *current_entry,
+            };
+            if(!queue_operation(&operation))
+                throw_error("Too many operations waiting,\nlet some of them finish first.", ERROR_LEVEL_WARNING);
         }
         else if(kDown & KEY_X)
         {
@@ -716,8 +729,6 @@ bool themeplaza_browser(EntryMode mode)
     free_icons(current_list);
     free(current_list->entries);
     free(current_list->tp_search);
-
-    return downloaded;
 }
 
 u32 http_get(const char *url, char ** filename, char ** buf, InstallType install_type)
@@ -856,6 +867,8 @@ u32 http_get(const char *url, char ** filename, char ** buf, InstallType install
 
         if(content_size && install_type != INSTALL_NONE)
             draw_loading_bar(size, content_size, install_type);
+        if(content_size)
+            operation_progress(size, content_size);
 
         if (ret == (s32)HTTPC_RESULTCODE_DOWNLOADPENDING)
         {
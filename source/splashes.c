@@ -27,34 +27,93 @@
 #include "unicode.h"
 #include "fs.h"
 #include "draw.h"
+#include "hashcache.h"
+#include "installlog.h"
 
 void splash_delete(void)
 {
+    lock_installed_files();
     remove("/luma/splash.bin");
     remove("/luma/splashbottom.bin");
+    unlock_installed_files();
 }
 
-void splash_install(Entry_s splash)
+// Same as load_data_hashed, with the stream kept around long enough to see where its time went
+static u32 load_screen(char * filename, Entry_s splash, char ** buf, File_Hash_s * hash, Install_Stats_s * stats)
 {
+    u64 start = svcGetSystemTick();
+    Stream_s * stream = open_data_stream(filename, splash);
+    if(stream == NULL)
+        return 0;
+
+    u32 size = stream_to_buf(stream, buf, hash, true);
+    install_stats_add_stream(stats, stream, svcGetSystemTick() - start, size);
+    stream_close(stream);
+    return size;
+}
+
+static Result write_screen(const char * path, const char * buf, u32 size, Install_Stats_s * stats)
+{
+    u64 start = svcGetSystemTick();
+    Result res = write_new_file(fsMakePath(PATH_ASCII, path), ArchiveSD, buf, size);
+    install_stats_add(stats, INSTALL_PHASE_WRITE, start, size);
+    return res;
+}
+
+Result splash_install(Entry_s splash)
+{
+    Result res = 0;
     char *screen_buf = NULL;
+    File_Hash_s hash;
+    Install_Stats_s stats = {0};
 
-    u32 size = load_data("/splash.bin", splash, &screen_buf);
+    lock_installed_files();
+    u64 start = svcGetSystemTick();
+    hash_cache_forget_sd_file("/luma/splash.bin");
+    hash_cache_forget_sd_file("/luma/splashbottom.bin");
+
+    // Splashes are small enough to hash fully while they're read, the check that follows an
+    // install then finds both sides in the hash cache
+    Result write_res = 0;
+    u32 size = load_screen("/splash.bin", splash, &screen_buf, &hash, &stats);
     if(size != 0)
     {
-        remake_file(fsMakePath(PATH_ASCII, "/luma/splash.bin"), ArchiveSD, size);
-        buf_to_file(size, fsMakePath(PATH_ASCII, "/luma/splash.bin"), ArchiveSD, screen_buf);
+        if(R_SUCCEEDED(write_res = write_screen("/luma/splash.bin", screen_buf, size, &stats)))
+        {
+            hash_cache_put_data("/splash.bin", splash, NULL, &hash);
+            hash_cache_put_sd_file("/luma/splash.bin", &hash);
+        }
+        free(screen_buf);
+        screen_buf = NULL;
     }
 
-    u32 bottom_size = load_data("/splashbottom.bin", splash, &screen_buf);
+    u32 bottom_size = load_screen("/splashbottom.bin", splash, &screen_buf, &hash, &stats);
     if(bottom_size != 0)
     {
-        remake_file(fsMakePath(PATH_ASCII, "/luma/splashbottom.bin"), ArchiveSD, bottom_size);
-        buf_to_file(bottom_size, fsMakePath(PATH_ASCII, "/luma/splashbottom.bin"), ArchiveSD, screen_buf);
+        Result bottom_res = write_screen("/luma/splashbottom.bin", screen_buf, bottom_size, &stats);
+        if(R_SUCCEEDED(bottom_res))
+        {
+            hash_cache_put_data("/splashbottom.bin", splash, NULL, &hash);
+            hash_cache_put_sd_file("/luma/splashbottom.bin", &hash);
+        }
+        else if(R_SUCCEEDED(write_res))
+        {
+            write_res = bottom_res;
+        }
+        free(screen_buf);
     }
 
-    if(size == 0 && bottom_size == 0)
+    int screens = (size != 0) + (bottom_size != 0);
+    if(screens == 0)
     {
         throw_error("No splash.bin or splashbottom.bin found.\nIs this a splash?", ERROR_LEVEL_WARNING);
+        res = MAKERESULT(RL_PERMANENT, RS_CANCELED, RM_APPLICATION, RD_NOT_FOUND);
+    }
+    else if(R_FAILED(write_res))
+    {
+        DEBUG("<splash_install> Couldn't write the splash: %lx\n", write_res);
+        throw_error("Couldn't write the splash to /luma.", ERROR_LEVEL_ERROR);
+        res = write_res;
     }
     else
     {
@@ -69,6 +128,12 @@ void splash_install(Entry_s splash)
             }
         }
     }
+
+    u64 total_ticks = svcGetSystemTick() - start;
+    unlock_installed_files();
+
+    log_install_stats(&stats, "splash", screens, total_ticks, res);
+    return res;
 }
 
 void splash_check_installed(void * void_arg)
@@ -78,53 +143,52 @@ void splash_check_installed(void * void_arg)
     if(list == NULL || list->entries == NULL) return;
 
     #ifndef CITRA_MODE
-    char * top_buf = NULL;
-    u32 top_size = file_to_buf(fsMakePath(PATH_ASCII, "/luma/splash.bin"), ArchiveSD, &top_buf);
-    char * bottom_buf = NULL;
-    u32 bottom_size = file_to_buf(fsMakePath(PATH_ASCII, "/luma/splashbottom.bin"), ArchiveSD, &bottom_buf);
+    lock_installed_files();
+    // A missing screen hashes to 0 on both sides, so it only matches another missing one
+    u32 top_hash = 0;
+    u32 bottom_hash = 0;
+    bool top_found = hash_sd_file("/luma/splash.bin", &top_hash, NULL);
+    bool bottom_found = hash_sd_file("/luma/splashbottom.bin", &bottom_hash, NULL);
 
-    if(!top_size && !bottom_size)
+    if(!top_found && !bottom_found)
     {
-        free(top_buf);
-        free(bottom_buf);
+        unlock_installed_files();
         return;
     }
 
-    #define HASH_SIZE_BYTES 256/8
-    u8 top_hash[HASH_SIZE_BYTES] = {0};
-    FSUSER_UpdateSha256Context(top_buf, top_size, top_hash);
-    free(top_buf);
-    top_buf = NULL;
-    u8 bottom_hash[HASH_SIZE_BYTES] = {0};
-    FSUSER_UpdateSha256Context(bottom_buf, bottom_size, bottom_hash);
-    free(bottom_buf);
-    bottom_buf = NULL;
-
     for(int i = 0; i < list->entries_count && arg->run_thread; i++)
     {
         Entry_s * splash = &list->entries[i];
-        top_size = load_data("/splash.bin", *splash, &top_buf);
-        bottom_size = load_data("/splashbottom.bin", *splash, &bottom_buf);
+        u32 splash_top_hash = 0;
+        u32 splash_bottom_hash = 0;
+        bool splash_top_found = hash_data("/splash.bin", *splash, &splash_top_hash, NULL);
+        bool splash_bottom_found = hash_data("/splashbottom.bin", *splash, &splash_bottom_hash, NULL);
 
-        if(!top_size && !bottom_size)
+        if(!splash_top_found && !splash_bottom_found)
         {
             continue;
         }
 
-        u8 splash_top_hash[HASH_SIZE_BYTES] = {0};
-        FSUSER_UpdateSha256Context(top_buf, top_size, splash_top_hash);
-        free(top_buf);
-        top_buf = NULL;
-        u8 splash_bottom_hash[HASH_SIZE_BYTES] = {0};
-        FSUSER_UpdateSha256Context(bottom_buf, bottom_size, splash_bottom_hash);
-        free(bottom_buf);
-        bottom_buf = NULL;
-
-        if(!memcmp(splash_bottom_hash, bottom_hash, HASH_SIZE_BYTES) && !memcmp(splash_top_hash, top_hash, HASH_SIZE_BYTES))
+        if(splash_top_found != top_found || splash_bottom_found != bottom_found ||
+           splash_top_hash != top_hash || splash_bottom_hash != bottom_hash)
         {
-            splash->installed = true;
-            break;
+            continue;
         }
+
+        // Confirm the fast hashes with SHA-256 before calling it installed
+        u8 sha[SHA256_SIZE], splash_sha[SHA256_SIZE];
+        if(top_found && (!hash_sd_file("/luma/splash.bin", &top_hash, sha) ||
+                         !hash_data("/splash.bin", *splash, &splash_top_hash, splash_sha) || memcmp(sha, splash_sha, SHA256_SIZE)))
+            continue;
+        if(bottom_found && (!hash_sd_file("/luma/splashbottom.bin", &bottom_hash, sha) ||
+                            !hash_data("/splashbottom.bin", *splash, &splash_bottom_hash, splash_sha) || memcmp(sha, splash_sha, SHA256_SIZE)))
+            continue;
+
+        splash->installed = true;
+        break;
     }
+
+    save_hash_cache();
+    unlock_installed_files();
     #endif
 }
\ No newline at end of file
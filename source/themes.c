@@ -28,182 +28,588 @@
 #include "unicode.h"
 #include "fs.h"
 #include "draw.h"
+#include "hashcache.h"
+#include "queue.h"
+#include "installlog.h"
 
 #define BODY_CACHE_SIZE 0x150000
 #define BGM_MAX_SIZE 0x337000
 
-static Result install_theme_internal(Entry_List_s themes, int installmode)
+// ThemeManage.bin and SaveData.dat are only read and written where the fields used are,
+// straight into or out of the same offsets of a struct laid out like the file
+#define THEME_MANAGE_HEADER 0, offsetof(ThemeManage_bin_s, _padding1)
+#define THEME_MANAGE_SHUFFLE_SIZES offsetof(ThemeManage_bin_s, shuffle_body_sizes), 2*sizeof(u32)*MAX_SHUFFLE_THEMES
+#define SAVEDATA_THEME_FIELDS offsetof(SaveData_dat_s, theme_entry), offsetof(SaveData_dat_s, shuffle) + sizeof(bool) - offsetof(SaveData_dat_s, theme_entry)
+#define SAVEDATA_SHUFFLE offsetof(SaveData_dat_s, shuffle), sizeof(bool)
+
+static Result read_theme_manage(ThemeManage_bin_s * theme_manage, u32 offset, u32 size)
+{
+    return file_read_range(fsMakePath(PATH_ASCII, "/ThemeManage.bin"), ArchiveThemeExt, offset, (char *)theme_manage + offset, size);
+}
+
+static Result write_theme_manage(const ThemeManage_bin_s * theme_manage, u32 offset, u32 size)
+{
+    return file_write_range(fsMakePath(PATH_ASCII, "/ThemeManage.bin"), ArchiveThemeExt, offset, (const char *)theme_manage + offset, size);
+}
+
+static Result read_savedata(SaveData_dat_s * savedata, u32 offset, u32 size)
+{
+    return file_read_range(fsMakePath(PATH_ASCII, "/SaveData.dat"), ArchiveHomeExt, offset, (char *)savedata + offset, size);
+}
+
+static Result write_savedata(const SaveData_dat_s * savedata, u32 offset, u32 size)
+{
+    return file_write_range(fsMakePath(PATH_ASCII, "/SaveData.dat"), ArchiveHomeExt, offset, (const char *)savedata + offset, size);
+}
+
+// The manifest is only trusted while ThemeManage.bin still has the sizes it recorded,
+// otherwise something else has installed themes since and every slot is rewritten
+static bool load_shuffle_manifest(Shuffle_Manifest_s * manifest)
+{
+    char * manifest_buf = NULL;
+    u32 manifest_size = file_to_buf(fsMakePath(PATH_ASCII, SHUFFLE_MANIFEST_PATH), ArchiveSD, &manifest_buf);
+    bool valid = manifest_size == sizeof(Shuffle_Manifest_s) && ((Shuffle_Manifest_s *)manifest_buf)->magic == SHUFFLE_MANIFEST_MAGIC;
+    if(valid) memcpy(manifest, manifest_buf, sizeof(Shuffle_Manifest_s));
+    free(manifest_buf);
+    if(!valid) return false;
+
+    ThemeManage_bin_s theme_manage;
+    if(R_FAILED(read_theme_manage(&theme_manage, THEME_MANAGE_SHUFFLE_SIZES)))
+        return false;
+    return !memcmp(theme_manage.shuffle_body_sizes, manifest->body_sizes, sizeof(manifest->body_sizes)) &&
+           !memcmp(theme_manage.shuffle_music_sizes, manifest->music_sizes, sizeof(manifest->music_sizes));
+}
+
+// Theme files are copied into the extdata this much at a time, so an install never holds
+// more than INSTALL_PIPELINE_DEPTH chunks of them in memory, however big the theme is
+#define INSTALL_CHUNK_SIZE 0x10000
+#define INSTALL_PIPELINE_DEPTH 4
+
+// A theme file to copy into a slot of the shuffle caches
+typedef struct {
+    Entry_s * theme;
+    char * filename;
+    u32 size;
+    int slot;
+    bool is_body;
+} Install_Copy_s;
+
+typedef struct {
+    char * data;
+    u32 size;
+    bool failed;
+} Install_Chunk_s;
+
+// Everything a shuffle install is going to write, worked out before the first write
+typedef struct {
+    int count;
+    Entry_s * themes[MAX_SHUFFLE_THEMES];
+    Data_Info_s body_infos[MAX_SHUFFLE_THEMES];
+    Data_Info_s music_infos[MAX_SHUFFLE_THEMES];
+    u32 body_keys[MAX_SHUFFLE_THEMES];
+    u32 music_keys[MAX_SHUFFLE_THEMES];
+
+    Install_Copy_s copies[MAX_SHUFFLE_THEMES * 2];
+    int copies_count;
+    u64 copies_size;
+    int slots_skipped;
+} Install_Plan_s;
+
+typedef struct {
+    const Install_Plan_s * plan;
+
+    Install_Chunk_s chunks[INSTALL_PIPELINE_DEPTH];
+    LightSemaphore free_chunks;
+    LightSemaphore ready;
+    volatile bool cancel;
+
+    // Bodies are hashed as they're read, so checking what's installed afterwards needn't read them again
+    File_Hash_s hashes[MAX_SHUFFLE_THEMES * 2];
+    bool hashed[MAX_SHUFFLE_THEMES * 2];
+
+    u64 read_ticks;
+    Install_Stats_s * stats; // the reader only adds to the read and inflate phases
+} Install_Pipeline_s;
+
+// Reads and inflates the files to copy, a chunk ahead of the chunks being written
+static void install_reader_thread(void * arg)
+{
+    Install_Pipeline_s * pipeline = (Install_Pipeline_s *)arg;
+    u32 chunk_index = 0;
+    bool failed = false;
+
+    for(int i = 0; i < pipeline->plan->copies_count && !failed; i++)
+    {
+        const Install_Copy_s * copy = &pipeline->plan->copies[i];
+        u64 start = svcGetSystemTick();
+        Stream_s * stream = open_data_stream(copy->filename, *copy->theme);
+        if(stream != NULL && copy->is_body)
+            stream_hash(stream, false);
+        u64 copy_ticks = svcGetSystemTick() - start;
+        u64 copy_bytes = 0;
+
+        u32 left = copy->size;
+        while(left && !failed)
+        {
+            LightSemaphore_Acquire(&pipeline->free_chunks, 1);
+            if(pipeline->cancel)
+            {
+                failed = true;
+                break;
+            }
+
+            Install_Chunk_s * chunk = &pipeline->chunks[chunk_index++ % INSTALL_PIPELINE_DEPTH];
+            u32 wanted = left < INSTALL_CHUNK_SIZE ? left : INSTALL_CHUNK_SIZE;
+            start = svcGetSystemTick();
+            chunk->size = stream != NULL ? stream_read(stream, chunk->data, wanted) : 0;
+            copy_ticks += svcGetSystemTick() - start;
+            copy_bytes += chunk->size;
+
+            chunk->failed = chunk->size != wanted;
+            failed = chunk->failed;
+            left -= chunk->size;
+            LightSemaphore_Release(&pipeline->ready, 1);
+        }
+
+        pipeline->read_ticks += copy_ticks;
+        if(stream != NULL)
+        {
+            install_stats_add_stream(pipeline->stats, stream, copy_ticks, copy_bytes);
+            if(!failed && copy->is_body)
+                pipeline->hashed[i] = stream_hash_result(stream, &pipeline->hashes[i]);
+            stream_close(stream);
+        }
+    }
+}
+
+// Copies a theme file into a file of the theme extdata, a chunk at a time.
+// Its fast hash is worked out on the way when hash isn't NULL.
+static Result copy_data_to_file(char * filename, Entry_s theme, u32 size, FS_Path path, File_Hash_s * hash, Install_Stats_s * stats)
 {
     Result res = 0;
-    char* music = NULL;
-    u32 music_size = 0;
-    u32 shuffle_music_sizes[MAX_SHUFFLE_THEMES] = {0};
-    char* body = NULL;
-    u32 body_size = 0;
-    u32 shuffle_body_sizes[MAX_SHUFFLE_THEMES] = {0};
+    u64 start = svcGetSystemTick();
+    Stream_s * stream = open_data_stream(filename, theme);
+    if(stream == NULL)
+        return MAKERESULT(RL_PERMANENT, RS_CANCELED, RM_APPLICATION, RD_NOT_FOUND);
+    if(hash != NULL)
+        stream_hash(stream, false);
+    u64 read_ticks = svcGetSystemTick() - start;
+
+    Handle handle;
+    if(R_FAILED(res = FSUSER_OpenFile(&handle, ArchiveThemeExt, path, FS_OPEN_WRITE, 0)))
+    {
+        stream_close(stream);
+        return res;
+    }
 
-    if(installmode & THEME_INSTALL_SHUFFLE)
+    char * chunk = malloc(INSTALL_CHUNK_SIZE);
+    u32 offset = 0;
+    while(offset < size)
+    {
+        u32 wanted = size - offset < INSTALL_CHUNK_SIZE ? size - offset : INSTALL_CHUNK_SIZE;
+        start = svcGetSystemTick();
+        if(stream_read(stream, chunk, wanted) != wanted)
+        {
+            res = MAKERESULT(RL_PERMANENT, RS_CANCELED, RM_APPLICATION, RD_NO_DATA);
+            break;
+        }
+        read_ticks += svcGetSystemTick() - start;
+
+        start = svcGetSystemTick();
+        if(R_FAILED(res = FSFILE_Write(handle, NULL, offset, chunk, wanted, 0))) break;
+        install_stats_add(stats, INSTALL_PHASE_WRITE, start, wanted);
+        offset += wanted;
+        operation_progress(offset, size);
+    }
+    install_stats_add_stream(stats, stream, read_ticks, offset);
+
+    start = svcGetSystemTick();
+    if(R_SUCCEEDED(res)) res = FSFILE_Flush(handle);
+    install_stats_add(stats, INSTALL_PHASE_FLUSH, start, 0);
+    if(R_SUCCEEDED(res) && hash != NULL)
+        stream_hash_result(stream, hash); // never seeked, so it covers the whole file
+
+    FSFILE_Close(handle);
+    free(chunk);
+    stream_close(stream);
+    return res;
+}
+
+static Result zero_file(FS_Path path, u32 size, Install_Stats_s * stats)
+{
+    Result res = 0;
+    Handle handle;
+    if(R_FAILED(res = FSUSER_OpenFile(&handle, ArchiveThemeExt, path, FS_OPEN_WRITE, 0))) return res;
+
+    char * zeros = calloc(INSTALL_CHUNK_SIZE, 1);
+    u64 start = svcGetSystemTick();
+    for(u32 offset = 0; offset < size && R_SUCCEEDED(res); offset += INSTALL_CHUNK_SIZE)
+        res = FSFILE_Write(handle, NULL, offset, zeros, size - offset < INSTALL_CHUNK_SIZE ? size - offset : INSTALL_CHUNK_SIZE, 0);
+    install_stats_add(stats, INSTALL_PHASE_WRITE, start, size);
+    start = svcGetSystemTick();
+    if(R_SUCCEEDED(res)) res = FSFILE_Flush(handle);
+    install_stats_add(stats, INSTALL_PHASE_FLUSH, start, 0);
+
+    FSFILE_Close(handle);
+    free(zeros);
+    return res;
+}
+
+// Only looks at zip central directories and file sizes: nothing is inflated or written, so a set
+// that can't be installed is turned down before the extdata is touched
+static Result plan_shuffle_install(Entry_List_s * themes, int installmode, Install_Plan_s * plan)
+{
+    memset(plan, 0, sizeof(Install_Plan_s));
+
+    if(themes->shuffle_count < 2)
     {
-        if(themes.shuffle_count < 2)
+        DEBUG("not enough themes selected for shuffle\n");
+        return MAKERESULT(RL_USAGE, RS_INVALIDARG, RM_COMMON, RD_INVALID_SELECTION);
+    }
+
+    if(themes->shuffle_count > MAX_SHUFFLE_THEMES)
+    {
+        DEBUG("too many themes selected for shuffle\n");
+        return MAKERESULT(RL_USAGE, RS_INVALIDARG, RM_COMMON, RD_INVALID_SELECTION);
+    }
+
+    for(int i = 0; i < themes->entries_count && plan->count < MAX_SHUFFLE_THEMES; i++)
+    {
+        Entry_s * current_theme = &themes->entries[i];
+        if(!current_theme->in_shuffle) continue;
+
+        Data_Info_s * body_info = &plan->body_infos[plan->count];
+        Data_Info_s * music_info = &plan->music_infos[plan->count];
+        if(installmode & THEME_INSTALL_BODY)
         {
-            DEBUG("not enough themes selected for shuffle\n");
-            return MAKERESULT(RL_USAGE, RS_INVALIDARG, RM_COMMON, RD_INVALID_SELECTION);
+            if(!get_data_info("/body_LZ.bin", *current_theme, body_info) || body_info->size == 0)
+            {
+                DEBUG("body not found for shuffle theme %i\n", plan->count);
+                throw_error("No body_LZ.bin found - is this a theme?", ERROR_LEVEL_WARNING);
+                return MAKERESULT(RL_PERMANENT, RS_CANCELED, RM_APPLICATION, RD_NOT_FOUND);
+            }
+            if(body_info->size > BODY_CACHE_SIZE)
+            {
+                DEBUG("body too big for shuffle theme %i: %lu\n", plan->count, body_info->size);
+                return MAKERESULT(RL_PERMANENT, RS_CANCELED, RM_APPLICATION, RD_TOO_LARGE);
+            }
+            plan->body_keys[plan->count] = entry_key(current_theme->path, "/body_LZ.bin");
         }
 
-        if(themes.shuffle_count > MAX_SHUFFLE_THEMES)
+        if((installmode & THEME_INSTALL_BGM) && !current_theme->no_bgm_shuffle)
         {
-            DEBUG("too many themes selected for shuffle\n");
-            return MAKERESULT(RL_USAGE, RS_INVALIDARG, RM_COMMON, RD_INVALID_SELECTION);
+            get_data_info("/bgm.bcstm", *current_theme, music_info);
+            if(music_info->size > BGM_MAX_SIZE)
+            {
+                DEBUG("bgm too big for shuffle theme %i: %lu\n", plan->count, music_info->size);
+                return MAKERESULT(RL_PERMANENT, RS_CANCELED, RM_APPLICATION, RD_TOO_LARGE);
+            }
+            if(music_info->size)
+                plan->music_keys[plan->count] = entry_key(current_theme->path, "/bgm.bcstm");
         }
 
-        char * padded = NULL;
+        plan->themes[plan->count++] = current_theme;
+    }
 
-        int shuffle_count = 0;
-        Handle body_cache_handle;
+    if(plan->count != themes->shuffle_count)
+    {
+        DEBUG("%i themes marked for shuffle, expected %i\n", plan->count, themes->shuffle_count);
+        return MAKERESULT(RL_USAGE, RS_INVALIDARG, RM_COMMON, RD_INVALID_SELECTION);
+    }
+
+    // The home menu only reads as much of each slot as ThemeManage.bin says, so only the
+    // payloads are written into files kept at their full size, never the padding after them.
+    // Slots still holding what the last install put there aren't written at all.
+    Shuffle_Manifest_s manifest;
+    bool manifest_valid = load_shuffle_manifest(&manifest);
+    bool body_cache_ready = manifest_valid &&
+        get_file_size(fsMakePath(PATH_ASCII, "/BodyCache_rd.bin"), ArchiveThemeExt) == BODY_CACHE_SIZE * MAX_SHUFFLE_THEMES;
 
+    for(int i = 0; i < plan->count; i++)
+    {
         if(installmode & THEME_INSTALL_BODY)
         {
-            remake_file(fsMakePath(PATH_ASCII, "/BodyCache_rd.bin"), ArchiveThemeExt, BODY_CACHE_SIZE * MAX_SHUFFLE_THEMES);
-            FSUSER_OpenFile(&body_cache_handle, ArchiveThemeExt, fsMakePath(PATH_ASCII, "/BodyCache_rd.bin"), FS_OPEN_WRITE, 0);
+            if(body_cache_ready && manifest.body_keys[i] == plan->body_keys[i] &&
+               !memcmp(&manifest.body_sources[i], &plan->body_infos[i], sizeof(Data_Info_s)))
+            {
+                plan->slots_skipped++;
+            }
+            else
+            {
+                plan->copies[plan->copies_count++] = (Install_Copy_s){plan->themes[i], "/body_LZ.bin", plan->body_infos[i].size, i, true};
+                plan->copies_size += plan->body_infos[i].size;
+            }
         }
 
-        for(int i = 0; i < themes.entries_count; i++)
+        if((installmode & THEME_INSTALL_BGM) && plan->music_infos[i].size)
         {
-            Entry_s * current_theme = &themes.entries[i];
+            char bgm_cache_path[26] = {0};
+            sprintf(bgm_cache_path, "/BgmCache_%.2i.bin", i);
+            bool bgm_cache_ready = manifest_valid &&
+                get_file_size(fsMakePath(PATH_ASCII, bgm_cache_path), ArchiveThemeExt) == BGM_MAX_SIZE;
 
-            if(current_theme->in_shuffle)
+            if(bgm_cache_ready && manifest.music_keys[i] == plan->music_keys[i] &&
+               !memcmp(&manifest.music_sources[i], &plan->music_infos[i], sizeof(Data_Info_s)))
             {
-                if(installmode & THEME_INSTALL_BODY)
-                {
-                    body_size = load_data("/body_LZ.bin", *current_theme, &body);
-                    if(body_size == 0)
-                    {
-                        free(body);
-                        DEBUG("body not found\n");
-                        throw_error("No body_LZ.bin found - is this a theme?", ERROR_LEVEL_WARNING);
-                        return MAKERESULT(RL_PERMANENT, RS_CANCELED, RM_APPLICATION, RD_NOT_FOUND);
-                    }
+                plan->slots_skipped++;
+            }
+            else
+            {
+                plan->copies[plan->copies_count++] = (Install_Copy_s){plan->themes[i], "/bgm.bcstm", plan->music_infos[i].size, i, false};
+                plan->copies_size += plan->music_infos[i].size;
+            }
+        }
+    }
 
-                    shuffle_body_sizes[shuffle_count] = body_size;
+    return 0;
+}
 
-                    padded = calloc(BODY_CACHE_SIZE, sizeof(char));
-                    memcpy(padded, body, body_size);
-                    free(body);
+static Result install_theme_files(Entry_List_s themes, int installmode, Install_Stats_s * stats)
+{
+    Result res = 0;
+    u32 music_size = 0;
+    u32 shuffle_music_sizes[MAX_SHUFFLE_THEMES] = {0};
+    u32 body_size = 0;
+    u32 shuffle_body_sizes[MAX_SHUFFLE_THEMES] = {0};
+    u64 bytes_written = 0;
+    Shuffle_Manifest_s manifest = {0};
 
-                    FSFILE_Write(body_cache_handle, NULL, BODY_CACHE_SIZE * shuffle_count, padded, BODY_CACHE_SIZE, FS_WRITE_FLUSH);
+    // Whatever happens next, the bodies in the extdata can't be trusted to match their sizes anymore
+    hash_cache_forget_extdata();
 
-                    free(padded);
-                    padded = NULL;
-                }
+    if(installmode & THEME_INSTALL_SHUFFLE)
+    {
+        Install_Plan_s plan;
+        if(R_FAILED(res = plan_shuffle_install(&themes, installmode, &plan)))
+            return res;
+        DEBUG("<install_theme_files> %i files to copy, %llu bytes, %i unchanged shuffle slots skipped\n",
+              plan.copies_count, plan.copies_size, plan.slots_skipped);
+
+        for(int i = 0; i < plan.count; i++)
+        {
+            shuffle_body_sizes[i] = plan.body_infos[i].size;
+            shuffle_music_sizes[i] = plan.music_infos[i].size;
+        }
+
+        // Removed until the install is done, so a failed one can't leave it describing half-written slots
+        FSUSER_DeleteFile(ArchiveSD, fsMakePath(PATH_ASCII, SHUFFLE_MANIFEST_PATH));
+
+        // Every file is at its full size before anything is written, or the install stops here
+        u64 prepare_start = svcGetSystemTick();
+        if((installmode & THEME_INSTALL_BODY) &&
+           R_FAILED(res = prepare_file(fsMakePath(PATH_ASCII, "/BodyCache_rd.bin"), ArchiveThemeExt, BODY_CACHE_SIZE * MAX_SHUFFLE_THEMES)))
+        {
+            DEBUG("couldn't prepare BodyCache_rd.bin: %lx\n", res);
+            return res;
+        }
 
-                if(installmode & THEME_INSTALL_BGM)
+        // Unused slots have a music size of 0 in ThemeManage.bin, they only need to exist
+        if(installmode & THEME_INSTALL_BGM)
+        {
+            for(int i = 0; i < MAX_SHUFFLE_THEMES; i++)
+            {
+                char bgm_cache_path[26] = {0};
+                sprintf(bgm_cache_path, "/BgmCache_%.2i.bin", i);
+                if(R_FAILED(res = prepare_file(fsMakePath(PATH_ASCII, bgm_cache_path), ArchiveThemeExt, BGM_MAX_SIZE)))
                 {
-                    char bgm_cache_path[26] = {0};
-                    sprintf(bgm_cache_path, "/BgmCache_%.2i.bin", shuffle_count);
-
-                    if(current_theme->no_bgm_shuffle)
-                    {
-                        music = NULL;
-                        music_size = 0;
-                    }
-                    else
-                    {
-                        music_size = load_data("/bgm.bcstm", *current_theme, &music);
-
-                        if(music_size > BGM_MAX_SIZE)
-                        {
-                            free(music);
-                            DEBUG("bgm too big\n");
-                            return MAKERESULT(RL_PERMANENT, RS_CANCELED, RM_APPLICATION, RD_TOO_LARGE);
-                        }
-                    }
-
-                    shuffle_music_sizes[shuffle_count] = music_size;
-                    remake_file(fsMakePath(PATH_ASCII, bgm_cache_path), ArchiveThemeExt, BGM_MAX_SIZE);
-
-                    Handle bgm_cache_handle;
-                    FSUSER_OpenFile(&bgm_cache_handle, ArchiveThemeExt, fsMakePath(PATH_ASCII, bgm_cache_path), FS_OPEN_WRITE, 0);
-
-                    padded = calloc(BGM_MAX_SIZE, sizeof(char));
-                    if(!current_theme->no_bgm_shuffle && music_size)
-                    {
-                        memcpy(padded, music, music_size);
-                        free(music);
-                    }
-
-                    FSFILE_Write(bgm_cache_handle, NULL, 0, padded, BGM_MAX_SIZE, FS_WRITE_FLUSH);
-
-                    FSFILE_Close(bgm_cache_handle);
-                    free(padded);
-                    padded = NULL;
+                    DEBUG("couldn't prepare %s: %lx\n", bgm_cache_path, res);
+                    return res;
                 }
+            }
+        }
 
-                shuffle_count++;
+        Handle body_cache_handle;
+        if((installmode & THEME_INSTALL_BODY) &&
+           R_FAILED(res = FSUSER_OpenFile(&body_cache_handle, ArchiveThemeExt, fsMakePath(PATH_ASCII, "/BodyCache_rd.bin"), FS_OPEN_WRITE, 0)))
+            return res;
+        install_stats_add(stats, INSTALL_PHASE_PREPARE, prepare_start, 0);
+
+        Install_Pipeline_s pipeline = {
+            .plan = &plan,
+            .stats = stats,
+        };
+
+        // The next chunks are read and inflated while this one is written to the extdata
+        for(int i = 0; i < INSTALL_PIPELINE_DEPTH; i++)
+            pipeline.chunks[i].data = malloc(INSTALL_CHUNK_SIZE);
+        // Room for the extra releases that wake the reader up when the install ends early
+        LightSemaphore_Init(&pipeline.free_chunks, INSTALL_PIPELINE_DEPTH, INSTALL_PIPELINE_DEPTH * 2);
+        LightSemaphore_Init(&pipeline.ready, 0, INSTALL_PIPELINE_DEPTH);
+        Thread reader = NULL;
+        if(plan.copies_count)
+        {
+            reader = threadCreate(install_reader_thread, &pipeline, 0x10000, 0x3f, -2, false);
+            if(reader == NULL)
+            {
+                DEBUG("couldn't start the install reader\n");
+                res = MAKERESULT(RL_PERMANENT, RS_OUTOFRESOURCE, RM_APPLICATION, RD_OUT_OF_MEMORY);
             }
         }
 
-        if(installmode & THEME_INSTALL_BGM)
+        u64 start = svcGetSystemTick();
+        u64 wait_ticks = 0;
+        u32 chunk_index = 0;
+        for(int i = 0; i < plan.copies_count && R_SUCCEEDED(res); i++)
         {
-            char * blank = calloc(BGM_MAX_SIZE, sizeof(char));
-            for(int i = shuffle_count; i < MAX_SHUFFLE_THEMES; i++)
+            const Install_Copy_s * copy = &plan.copies[i];
+            Handle handle = body_cache_handle;
+            u64 offset = 0;
+            if(copy->is_body)
+            {
+                offset = BODY_CACHE_SIZE * copy->slot;
+            }
+            else
             {
                 char bgm_cache_path[26] = {0};
-                sprintf(bgm_cache_path, "/BgmCache_%.2i.bin", i);
-                remake_file(fsMakePath(PATH_ASCII, bgm_cache_path), ArchiveThemeExt, BGM_MAX_SIZE);
-                buf_to_file(BGM_MAX_SIZE, fsMakePath(PATH_ASCII, bgm_cache_path), ArchiveThemeExt, blank);
+                sprintf(bgm_cache_path, "/BgmCache_%.2i.bin", copy->slot);
+                if(R_FAILED(res = FSUSER_OpenFile(&handle, ArchiveThemeExt, fsMakePath(PATH_ASCII, bgm_cache_path), FS_OPEN_WRITE, 0)))
+                    break;
+            }
+
+            for(u32 left = copy->size; left && R_SUCCEEDED(res);)
+            {
+                Install_Chunk_s * chunk = &pipeline.chunks[chunk_index++ % INSTALL_PIPELINE_DEPTH];
+                u64 wait_start = svcGetSystemTick();
+                LightSemaphore_Acquire(&pipeline.ready, 1);
+                wait_ticks += svcGetSystemTick() - wait_start;
+
+                if(chunk->failed)
+                {
+                    DEBUG("couldn't read %s of shuffle theme %i\n", copy->filename, copy->slot);
+                    res = MAKERESULT(RL_PERMANENT, RS_CANCELED, RM_APPLICATION, RD_NO_DATA);
+                    break;
+                }
+
+                u64 write_start = svcGetSystemTick();
+                res = FSFILE_Write(handle, NULL, offset, chunk->data, chunk->size, 0);
+                install_stats_add(stats, INSTALL_PHASE_WRITE, write_start, chunk->size);
+                offset += chunk->size;
+                left -= chunk->size;
+                bytes_written += chunk->size;
+                operation_progress(bytes_written, plan.copies_size);
+                LightSemaphore_Release(&pipeline.free_chunks, 1);
+            }
+
+            if(!copy->is_body)
+            {
+                u64 flush_start = svcGetSystemTick();
+                if(R_SUCCEEDED(res)) res = FSFILE_Flush(handle);
+                install_stats_add(stats, INSTALL_PHASE_FLUSH, flush_start, 0);
+                FSFILE_Close(handle);
             }
-            free(blank);
         }
 
+        if(reader != NULL)
+        {
+            // Let the reader run out if the install stopped early
+            pipeline.cancel = true;
+            LightSemaphore_Release(&pipeline.free_chunks, INSTALL_PIPELINE_DEPTH);
+            threadJoin(reader, U64_MAX);
+            threadFree(reader);
+        }
+        for(int i = 0; i < INSTALL_PIPELINE_DEPTH; i++)
+            free(pipeline.chunks[i].data);
+
         if(installmode & THEME_INSTALL_BODY)
         {
+            u64 flush_start = svcGetSystemTick();
+            if(R_SUCCEEDED(res)) res = FSFILE_Flush(body_cache_handle);
+            install_stats_add(stats, INSTALL_PHASE_FLUSH, flush_start, 0);
             FSFILE_Close(body_cache_handle);
         }
+        if(R_FAILED(res)) return res;
+
+        for(int i = 0; i < plan.copies_count; i++)
+        {
+            const Install_Copy_s * copy = &plan.copies[i];
+            if(!pipeline.hashed[i]) continue;
+            hash_cache_put_extdata("/BodyCache_rd.bin", BODY_CACHE_SIZE*copy->slot, copy->size, &pipeline.hashes[i]);
+            hash_cache_put_data(copy->filename, *copy->theme, &plan.body_infos[copy->slot], &pipeline.hashes[i]);
+        }
+
+        // With the reads hidden behind the writes, the total gets close to the larger of the two
+        u64 total_ticks = svcGetSystemTick() - start;
+        DEBUG("<install_theme_files> shuffle slots done in %llu ms: reading took %llu ms, writing %llu ms\n",
+              total_ticks / (SYSCLOCK_ARM11 / 1000), pipeline.read_ticks / (SYSCLOCK_ARM11 / 1000),
+              (total_ticks - wait_ticks) / (SYSCLOCK_ARM11 / 1000));
+
+        memcpy(manifest.body_sources, plan.body_infos, sizeof(plan.body_infos));
+        memcpy(manifest.music_sources, plan.music_infos, sizeof(plan.music_infos));
+        memcpy(manifest.body_keys, plan.body_keys, sizeof(plan.body_keys));
+        memcpy(manifest.music_keys, plan.music_keys, sizeof(plan.music_keys));
     }
     else
     {
         Entry_s current_theme = themes.entries[themes.selected_entry];
 
+        // Both sizes are checked before either file is touched
+        Data_Info_s body_info = {0};
+        Data_Info_s music_info = {0};
+        File_Hash_s body_hash;
+        bool body_copied = false;
         if(installmode & THEME_INSTALL_BODY)
         {
-            body_size = load_data("/body_LZ.bin", current_theme, &body);
-            if(body_size == 0)
+            if(!get_data_info("/body_LZ.bin", current_theme, &body_info) || body_info.size == 0)
             {
-                free(body);
                 DEBUG("body not found\n");
                 throw_error("No body_LZ.bin found - is this a theme?", ERROR_LEVEL_WARNING);
                 return MAKERESULT(RL_PERMANENT, RS_CANCELED, RM_APPLICATION, RD_NOT_FOUND);
             }
-
-            res = buf_to_file(body_size, fsMakePath(PATH_ASCII, "/BodyCache.bin"), ArchiveThemeExt, body); // Write body data to file
-            free(body);
-
-            if(R_FAILED(res)) return res;
+            if(body_info.size > BODY_CACHE_SIZE)
+            {
+                DEBUG("body too big\n");
+                return MAKERESULT(RL_PERMANENT, RS_CANCELED, RM_APPLICATION, RD_TOO_LARGE);
+            }
         }
-
         if(installmode & THEME_INSTALL_BGM)
         {
-            music_size = load_data("/bgm.bcstm", current_theme, &music);
-            if (music_size > BGM_MAX_SIZE)
+            get_data_info("/bgm.bcstm", current_theme, &music_info);
+            if (music_info.size > BGM_MAX_SIZE)
             {
-                free(music);
                 DEBUG("bgm too big\n");
                 return MAKERESULT(RL_PERMANENT, RS_CANCELED, RM_APPLICATION, RD_TOO_LARGE);
             }
+        }
+
+        if(installmode & THEME_INSTALL_BODY)
+        {
+            body_size = body_info.size;
+            res = copy_data_to_file("/body_LZ.bin", current_theme, body_size, fsMakePath(PATH_ASCII, "/BodyCache.bin"), &body_hash, stats); // Write body data to file
+
+            if(R_FAILED(res)) return res;
+            bytes_written += body_size;
+            body_copied = true;
+        }
 
+        if(installmode & THEME_INSTALL_BGM)
+        {
+            music_size = music_info.size;
             if (music_size != 0)
             {
-                remake_file(fsMakePath(PATH_ASCII, "/BgmCache.bin"), ArchiveThemeExt, BGM_MAX_SIZE);
-                res = buf_to_file(music_size, fsMakePath(PATH_ASCII, "/BgmCache.bin"), ArchiveThemeExt, music);
-                free(music);
+                u64 start = svcGetSystemTick();
+                if(R_FAILED(res = prepare_file(fsMakePath(PATH_ASCII, "/BgmCache.bin"), ArchiveThemeExt, BGM_MAX_SIZE)))
+                {
+                    DEBUG("couldn't prepare BgmCache.bin: %lx\n", res);
+                    return res;
+                }
+                install_stats_add(stats, INSTALL_PHASE_PREPARE, start, 0);
+                res = copy_data_to_file("/bgm.bcstm", current_theme, music_size, fsMakePath(PATH_ASCII, "/BgmCache.bin"), NULL, stats);
+                bytes_written += music_size;
 
                 char *body_buf = NULL;
+                start = svcGetSystemTick();
                 u32 uncompressed_size = decompress_lz_file(fsMakePath(PATH_ASCII, "/BodyCache.bin"), ArchiveThemeExt, &body_buf);
+                install_stats_add(stats, INSTALL_PHASE_LZ_DECODE, start, uncompressed_size);
                 if (body_buf[5] != 1)
                 {
                     installmode |= THEME_INSTALL_BODY;
                     body_buf[5] = 1;
+                    body_copied = false; // not the theme's body anymore
+                    // Includes writing the result back, which can't be told apart from the encoding
+                    start = svcGetSystemTick();
                     body_size = compress_lz_file_fast(fsMakePath(PATH_ASCII, "/BodyCache.bin"), ArchiveThemeExt, body_buf, uncompressed_size);
+                    install_stats_add(stats, INSTALL_PHASE_LZ_ENCODE, start, body_size);
+                    bytes_written += body_size;
                 }
                     
                 free(body_buf);
@@ -212,77 +618,116 @@ static Result install_theme_internal(Entry_List_s themes, int installmode)
             if(R_FAILED(res)) return res;
         } else
         {
-            music = calloc(BGM_MAX_SIZE, 1);
-            res = buf_to_file(BGM_MAX_SIZE, fsMakePath(PATH_ASCII, "/BgmCache.bin"), ArchiveThemeExt, music);
-            free(music);
+            res = zero_file(fsMakePath(PATH_ASCII, "/BgmCache.bin"), BGM_MAX_SIZE, stats);
+            bytes_written += BGM_MAX_SIZE;
+        }
+
+        if(body_copied)
+        {
+            hash_cache_put_extdata("/BodyCache.bin", 0, body_size, &body_hash);
+            hash_cache_put_data("/body_LZ.bin", current_theme, &body_info, &body_hash);
         }
     }
 
+    u64 metadata_start = svcGetSystemTick();
+    u64 metadata_bytes = bytes_written;
+
      //----------------------------------------
-    char* thememanage_buf = NULL;
-    file_to_buf(fsMakePath(PATH_ASCII, "/ThemeManage.bin"), ArchiveThemeExt, &thememanage_buf);
-    ThemeManage_bin_s * theme_manage = (ThemeManage_bin_s *)thememanage_buf;
+    // The header is read first: a single theme install leaves the size it doesn't install as it was
+    ThemeManage_bin_s theme_manage;
+    if(R_FAILED(res = read_theme_manage(&theme_manage, THEME_MANAGE_HEADER))) return res;
 
-    theme_manage->unk1 = 1;
-    theme_manage->unk2 = 0;
+    theme_manage.unk1 = 1;
+    theme_manage.unk2 = 0;
 
     if(installmode & THEME_INSTALL_SHUFFLE)
     {
-        theme_manage->music_size = 0;
-        theme_manage->body_size = 0;
+        theme_manage.music_size = 0;
+        theme_manage.body_size = 0;
 
         for(int i = 0; i < MAX_SHUFFLE_THEMES; i++)
         {
-            theme_manage->shuffle_body_sizes[i] = shuffle_body_sizes[i];
-            theme_manage->shuffle_music_sizes[i] = shuffle_music_sizes[i];
+            theme_manage.shuffle_body_sizes[i] = shuffle_body_sizes[i];
+            theme_manage.shuffle_music_sizes[i] = shuffle_music_sizes[i];
         }
+
+        if(R_FAILED(res = write_theme_manage(&theme_manage, THEME_MANAGE_SHUFFLE_SIZES))) return res;
+        bytes_written += 2*sizeof(u32)*MAX_SHUFFLE_THEMES;
     }
     else
     {
         if(installmode & THEME_INSTALL_BGM)
-            theme_manage->music_size = music_size;
+            theme_manage.music_size = music_size;
         if(installmode & THEME_INSTALL_BODY)
-            theme_manage->body_size = body_size;
+            theme_manage.body_size = body_size;
     }
 
-    theme_manage->unk3 = 0xFF;
-    theme_manage->unk4 = 1;
-    theme_manage->dlc_theme_content_index = 0xFF;
-    theme_manage->use_theme_cache = 0x0200;
+    theme_manage.unk3 = 0xFF;
+    theme_manage.unk4 = 1;
+    theme_manage.dlc_theme_content_index = 0xFF;
+    theme_manage.use_theme_cache = 0x0200;
 
-    res = buf_to_file(0x800, fsMakePath(PATH_ASCII, "/ThemeManage.bin"), ArchiveThemeExt, thememanage_buf);
-    free(thememanage_buf);
-    if(R_FAILED(res)) return res;
+    if(R_FAILED(res = write_theme_manage(&theme_manage, THEME_MANAGE_HEADER))) return res;
+    bytes_written += offsetof(ThemeManage_bin_s, _padding1);
     //----------------------------------------
 
     //----------------------------------------
-    char* savedata_buf = NULL;
-    u32 savedata_size = file_to_buf(fsMakePath(PATH_ASCII, "/SaveData.dat"), ArchiveHomeExt, &savedata_buf);
-    SaveData_dat_s* savedata = (SaveData_dat_s*)savedata_buf;
+    // From the theme entry to the shuffle flag, with the padding between them kept as it was
+    SaveData_dat_s savedata;
+    if(R_FAILED(res = read_savedata(&savedata, SAVEDATA_THEME_FIELDS))) return res;
 
-    memset(&savedata->theme_entry, 0, sizeof(ThemeEntry_s));
-    savedata->theme_entry.type = 3;
-    savedata->theme_entry.index = 0xff;
+    memset(&savedata.theme_entry, 0, sizeof(ThemeEntry_s));
+    savedata.theme_entry.type = 3;
+    savedata.theme_entry.index = 0xff;
 
-    savedata->shuffle = (installmode & THEME_INSTALL_SHUFFLE);
+    savedata.shuffle = (installmode & THEME_INSTALL_SHUFFLE);
     if(installmode & THEME_INSTALL_SHUFFLE)
     {
-        memset(savedata->shuffle_themes, 0, sizeof(ThemeEntry_s)*MAX_SHUFFLE_THEMES);
+        memset(savedata.shuffle_themes, 0, sizeof(ThemeEntry_s)*MAX_SHUFFLE_THEMES);
         for(int i = 0; i < themes.shuffle_count; i++)
         {
-            savedata->shuffle_themes[i].type = 3;
-            savedata->shuffle_themes[i].index = i;
+            savedata.shuffle_themes[i].type = 3;
+            savedata.shuffle_themes[i].index = i;
         }
     }
 
-    res = buf_to_file(savedata_size, fsMakePath(PATH_ASCII, "/SaveData.dat"), ArchiveHomeExt, savedata_buf);
-    free(savedata_buf);
-    if(R_FAILED(res)) return res;
+    if(R_FAILED(res = write_savedata(&savedata, SAVEDATA_THEME_FIELDS))) return res;
+    bytes_written += offsetof(SaveData_dat_s, shuffle) + sizeof(bool) - offsetof(SaveData_dat_s, theme_entry);
     //----------------------------------------
 
+    if(installmode & THEME_INSTALL_SHUFFLE)
+    {
+        manifest.magic = SHUFFLE_MANIFEST_MAGIC;
+        memcpy(manifest.body_sizes, shuffle_body_sizes, sizeof(manifest.body_sizes));
+        memcpy(manifest.music_sizes, shuffle_music_sizes, sizeof(manifest.music_sizes));
+        write_new_file(fsMakePath(PATH_ASCII, SHUFFLE_MANIFEST_PATH), ArchiveSD, (char *)&manifest, sizeof(manifest));
+    }
+    install_stats_add(stats, INSTALL_PHASE_METADATA, metadata_start, bytes_written - metadata_bytes);
+
+    DEBUG("<install_theme_files> %llu bytes written\n", bytes_written);
     return 0;
 }
 
+static Result install_theme_internal(Entry_List_s themes, int installmode)
+{
+    Install_Stats_s stats = {0};
+    lock_installed_files();
+    u64 start = svcGetSystemTick();
+    Result res = install_theme_files(themes, installmode, &stats);
+    u64 total_ticks = svcGetSystemTick() - start;
+    unlock_installed_files();
+
+    const char * kind = "theme";
+    if(installmode & THEME_INSTALL_SHUFFLE)
+        kind = "shuffle";
+    else if(!(installmode & THEME_INSTALL_BODY))
+        kind = "bgm";
+    else if(!(installmode & THEME_INSTALL_BGM))
+        kind = "no_bgm";
+    log_install_stats(&stats, kind, (installmode & THEME_INSTALL_SHUFFLE) ? themes.shuffle_count : 1, total_ticks, res);
+    return res;
+}
+
 inline Result theme_install(Entry_s theme)
 {
     Entry_List_s list = {0};
@@ -315,6 +760,94 @@ inline Result shuffle_install(Entry_List_s themes)
     return install_theme_internal(themes, THEME_INSTALL_SHUFFLE | THEME_INSTALL_BODY | THEME_INSTALL_BGM);
 }
 
+// Threads hashing the bodies of the themes in the list, so FS and inflate work overlap
+#define INSTALL_CHECK_WORKERS 3
+
+typedef struct {
+    Thread_Arg_s * arg;
+    Entry_List_s * list;
+    bool shuffle;
+
+    // The bodies in the extdata
+    u32 sizes[MAX_SHUFFLE_THEMES];
+    u32 hashes[MAX_SHUFFLE_THEMES];
+    bool hashed[MAX_SHUFFLE_THEMES];
+    int installed_count;
+    u32 generation; // of the extdata when its sizes and hashes were read
+    volatile bool stale; // a theme was installed since, the extdata above isn't there anymore
+
+    Handle mutex;
+    int next_entry;
+    int total_installed;
+} Install_Check_s;
+
+static void install_check_worker(void * void_arg)
+{
+    Install_Check_s * check = (Install_Check_s *)void_arg;
+
+    while(check->arg->run_thread && !check->stale)
+    {
+        svcWaitSynchronization(check->mutex, U64_MAX);
+        int i = check->next_entry++;
+        bool done = i >= check->list->entries_count || check->total_installed >= check->installed_count;
+        svcReleaseMutex(check->mutex);
+        if(done) break;
+
+        Entry_s * theme = &check->list->entries[i];
+        Data_Info_s info;
+        if(!get_data_info("/body_LZ.bin", *theme, &info)) continue;
+
+        // A body can only be installed if its size is one of the installed ones, no need to hash the others
+        bool candidate = false;
+        for(int j = 0; j < MAX_SHUFFLE_THEMES && !candidate; j++)
+            candidate = check->hashed[j] && check->sizes[j] == info.size;
+        if(!candidate) continue;
+
+        u32 theme_body_hash;
+        if(!hash_data_info("/body_LZ.bin", *theme, &info, &theme_body_hash, NULL)) continue;
+
+        u8 theme_body_sha[SHA256_SIZE];
+        bool theme_body_sha_done = false;
+        for(int j = 0; j < MAX_SHUFFLE_THEMES; j++)
+        {
+            if(!check->hashed[j] || check->hashes[j] != theme_body_hash) continue;
+
+            // The fast hashes match, only now is it worth comparing SHA-256s
+            u8 body_sha[SHA256_SIZE];
+            u32 body_hash;
+            if(!theme_body_sha_done)
+                theme_body_sha_done = hash_data_info("/body_LZ.bin", *theme, &info, &theme_body_hash, theme_body_sha);
+            if(!theme_body_sha_done) break;
+
+            // Only the extdata needs the lock, and only if no install got to it since it was looked at
+            lock_installed_files();
+            if(hash_cache_extdata_generation() != check->generation)
+            {
+                unlock_installed_files();
+                check->stale = true;
+                break;
+            }
+            bool body_hashed;
+            if(check->shuffle)
+                body_hashed = hash_extdata("/BodyCache_rd.bin", BODY_CACHE_SIZE*j, check->sizes[j], &body_hash, body_sha);
+            else
+                body_hashed = hash_extdata("/BodyCache.bin", 0, check->sizes[j], &body_hash, body_sha);
+            bool installed = body_hashed && !memcmp(body_sha, theme_body_sha, SHA256_SIZE);
+            if(installed)
+                theme->installed = true; // shows up on the next frame, without waiting for the other themes
+            unlock_installed_files();
+
+            if(installed)
+            {
+                svcWaitSynchronization(check->mutex, U64_MAX);
+                check->total_installed++;
+                svcReleaseMutex(check->mutex);
+                if(!check->shuffle) break; //only need to check the first if the installed theme inst shuffle
+            }
+        }
+    }
+}
+
 void themes_check_installed(void * void_arg)
 {
     Thread_Arg_s * arg = (Thread_Arg_s *)void_arg;
@@ -322,72 +855,69 @@ void themes_check_installed(void * void_arg)
     if(list == NULL || list->entries == NULL) return;
 
     #ifndef CITRA_MODE
-    char* savedata_buf = NULL;
-    u32 savedata_size = file_to_buf(fsMakePath(PATH_ASCII, "/SaveData.dat"), ArchiveHomeExt, &savedata_buf);
-    if(!savedata_size) return;
-    SaveData_dat_s* savedata = (SaveData_dat_s*)savedata_buf;
-    bool shuffle = savedata->shuffle;
-    free(savedata_buf);
-
-    #define HASH_SIZE_BYTES 256/8
-    u8 body_hash[MAX_SHUFFLE_THEMES][HASH_SIZE_BYTES];
-    memset(body_hash, 0, MAX_SHUFFLE_THEMES*HASH_SIZE_BYTES);
-
-    char* thememanage_buf = NULL;
-    u32 theme_manage_size = file_to_buf(fsMakePath(PATH_ASCII, "/ThemeManage.bin"), ArchiveThemeExt, &thememanage_buf);
-    if(!theme_manage_size) return;
-    ThemeManage_bin_s * theme_manage = (ThemeManage_bin_s *)thememanage_buf;
-
-    u32 single_body_size = theme_manage->body_size;
-    u32 shuffle_body_sizes[MAX_SHUFFLE_THEMES] = {0};
-    memcpy(shuffle_body_sizes, theme_manage->shuffle_body_sizes, sizeof(u32)*MAX_SHUFFLE_THEMES);
-    free(thememanage_buf);
-
-    if(shuffle)
+    lock_installed_files();
+    SaveData_dat_s savedata;
+    if(R_FAILED(read_savedata(&savedata, SAVEDATA_SHUFFLE)))
     {
-        char * body_buf = NULL;
-        u32 body_cache_size = file_to_buf(fsMakePath(PATH_ASCII, "/BodyCache_rd.bin"), ArchiveThemeExt, &body_buf);
-        if(!body_cache_size) return;
-
-        for(int i = 0; i < MAX_SHUFFLE_THEMES; i++)
+        unlock_installed_files();
+        return;
+    }
+    Install_Check_s check = {
+        .arg = arg,
+        .list = list,
+        .shuffle = savedata.shuffle,
+    };
+
+    ThemeManage_bin_s theme_manage;
+    if(check.shuffle)
+    {
+        if(R_FAILED(read_theme_manage(&theme_manage, THEME_MANAGE_SHUFFLE_SIZES)))
         {
-            FSUSER_UpdateSha256Context(body_buf + BODY_CACHE_SIZE*i, shuffle_body_sizes[i], body_hash[i]);
+            unlock_installed_files();
+            return;
         }
-
-        free(body_buf);
+        memcpy(check.sizes, theme_manage.shuffle_body_sizes, sizeof(u32)*MAX_SHUFFLE_THEMES);
     }
     else
     {
-        char * body_buf = NULL;
-        u32 body_size = file_to_buf(fsMakePath(PATH_ASCII, "/BodyCache.bin"), ArchiveThemeExt, &body_buf);
-        if(!body_size) return;
-
-        u8 * hash = body_hash[0];
-        FSUSER_UpdateSha256Context(body_buf, single_body_size, hash);
-        free(body_buf);
+        if(R_FAILED(read_theme_manage(&theme_manage, THEME_MANAGE_HEADER)))
+        {
+            unlock_installed_files();
+            return;
+        }
+        check.sizes[0] = theme_manage.body_size;
     }
 
-    int total_installed = 0;
-    for(int i = 0; i < list->entries_count && total_installed < MAX_SHUFFLE_THEMES && arg->run_thread; i++)
+    // Only the installed bodies are read, a slot at a time, and only when their size changed
+    for(int i = 0; i < MAX_SHUFFLE_THEMES; i++)
     {
-        Entry_s * theme = &list->entries[i];
-        char * theme_body = NULL;
-        u32 theme_body_size = load_data("/body_LZ.bin", *theme, &theme_body);
-        if(!theme_body_size) return;
-
-        u8 theme_body_hash[HASH_SIZE_BYTES];
-        FSUSER_UpdateSha256Context(theme_body, theme_body_size, theme_body_hash);
-        free(theme_body);
-
-        for(int j = 0; j < MAX_SHUFFLE_THEMES; j++)
-        {
-            if(!memcmp(body_hash[j], theme_body_hash, HASH_SIZE_BYTES))
-            {
-                theme->installed = true;
-                total_installed++;
-                if(!shuffle) break; //only need to check the first if the installed theme inst shuffle
-            }
-        }
+        if(check.shuffle)
+            check.hashed[i] = hash_extdata("/BodyCache_rd.bin", BODY_CACHE_SIZE*i, check.sizes[i], &check.hashes[i], NULL);
+        else if(i == 0)
+            check.hashed[i] = hash_extdata("/BodyCache.bin", 0, check.sizes[i], &check.hashes[i], NULL);
+        if(check.hashed[i]) check.installed_count++;
     }
+    check.generation = hash_cache_extdata_generation();
+    // The themes on the SD card are hashed without it, installs queued meanwhile don't wait on that
+    unlock_installed_files();
+
+    u64 start = svcGetSystemTick();
+    svcCreateMutex(&check.mutex, false);
+    Thread workers[INSTALL_CHECK_WORKERS] = {0};
+    for(int i = 0; i < INSTALL_CHECK_WORKERS; i++)
+        workers[i] = threadCreate(install_check_worker, &check, 0x10000, 0x3f, -2, false);
+
+    install_check_worker(&check);
+    for(int i = 0; i < INSTALL_CHECK_WORKERS; i++)
+    {
+        if(workers[i] == NULL) continue;
+        threadJoin(workers[i], U64_MAX);
+        threadFree(workers[i]);
+    }
+    svcCloseHandle(check.mutex);
+    DEBUG("<themes_check_installed> %i of %i installed themes found in %llu ms\n", check.total_installed,
+          check.installed_count, (svcGetSystemTick() - start) / (SYSCLOCK_ARM11 / 1000));
+
+    save_hash_cache();
     #endif
 }
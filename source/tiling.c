@@ -0,0 +1,82 @@
+/*
+*   This file is part of Anemone3DS
+*   Copyright (C) 2016-2018 Contributors in CONTRIBUTORS.md
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*   Additional Terms 7.b and 7.c of GPLv3 apply to this file:
+*       * Requiring preservation of specified reasonable legal notices or
+*         author attributions in that material or in the Appropriate Legal
+*         Notices displayed by works containing it.
+*       * Prohibiting misrepresentation of the origin of that material,
+*         or requiring that modified versions of such material be marked in
+*         reasonable ways as different from the original version.
+*/
+
+#include "tiling.h"
+
+const u8 tile_morton_x[8] = { 0x00, 0x01, 0x04, 0x05, 0x10, 0x11, 0x14, 0x15 };
+const u8 tile_morton_y[8] = { 0x00, 0x02, 0x08, 0x0A, 0x20, 0x22, 0x28, 0x2A };
+
+// Inside a tile, the pixels at x and x+1 (x even) are always next to each other,
+// so a row of 8 pixels is moved as 4 pairs instead of 8 single pixels
+static inline void tile_row(u8 * dst, const u8 * src, const u32 bpp)
+{
+    memcpy(dst + 0x00*bpp, src + 0*bpp, 2*bpp);
+    memcpy(dst + 0x04*bpp, src + 2*bpp, 2*bpp);
+    memcpy(dst + 0x10*bpp, src + 4*bpp, 2*bpp);
+    memcpy(dst + 0x14*bpp, src + 6*bpp, 2*bpp);
+}
+
+static inline void tile_image(u8 * dst, u32 tex_width, const u8 * src, u32 src_stride, u32 width, u32 height, const u32 bpp)
+{
+    const u32 tile_size = 8*8*bpp;
+    const u32 full_width = width & ~7;
+    const u32 full_height = height & ~7;
+
+    for(u32 y = 0; y < full_height; y += 8)
+    {
+        u8 * tile = dst + (y >> 3) * (tex_width >> 3) * tile_size;
+        const u8 * row = src + y * src_stride;
+        for(u32 x = 0; x < full_width; x += 8, tile += tile_size)
+        {
+            const u8 * px = row + x * bpp;
+            for(u32 j = 0; j < 8; j++, px += src_stride)
+                tile_row(tile + tile_morton_y[j] * bpp, px, bpp);
+        }
+    }
+
+    // Partial tiles on the right and bottom edges
+    for(u32 y = 0; y < height; y++)
+    {
+        u32 x = y < full_height ? full_width : 0;
+        for(; x < width; x++)
+            memcpy(dst + tile_offset(x, y, tex_width) * bpp, src + y * src_stride + x * bpp, bpp);
+    }
+}
+
+void tile_rgba8(void * dst, u32 tex_width, const void * src, u32 src_stride, u32 width, u32 height)
+{
+    tile_image(dst, tex_width, src, src_stride, width, height, 4);
+}
+
+void tile_rgb8(void * dst, u32 tex_width, const void * src, u32 src_stride, u32 width, u32 height)
+{
+    tile_image(dst, tex_width, src, src_stride, width, height, 3);
+}
+
+void tile_rgb565(void * dst, u32 tex_width, const void * src, u32 src_stride, u32 width, u32 height)
+{
+    tile_image(dst, tex_width, src, src_stride, width, height, 2);
+}